@@ -0,0 +1,282 @@
+#!/usr/bin/env bash
+set -euo pipefail
+
+# Usage: ./bench.sh [CASE...]   (default: all cases)
+#
+# Builds easylatex and times it on generated documents. Inputs and outputs
+# live in .itex_bench/; timings and peak memory come from --stats.
+
+BENCH_DIR=".itex_bench"
+mkdir -p "$BENCH_DIR"
+
+gcc -O2 -Wall -Wextra -std=c11 easylatex.c -o "$BENCH_DIR/easylatex"
+EL="$BENCH_DIR/easylatex"
+
+# A mixed document: sections, nested environments, lists, math, raw latex.
+gen_mixed_doc() {
+  awk -v n="$1" 'BEGIN {
+    print "title: Benchmark"
+    print "author: Bench"
+    print "maketitle:"
+    for (i = 0; i < n; i++) {
+      print "section: Section " i
+      print "Some text for section " i " with a \\n line break."
+      print "theorem:"
+      print "    Statement " i "."
+      print "    proof:"
+      print "        itemize:"
+      print "            - first point"
+      print "            - second point"
+      print "        math:"
+      print "            a_" i " &= b + c\\nd &= e"
+      print ""
+      print "            x &= y"
+      print "latex:"
+      print "    \\begin{tabular}{ll}"
+      print "    a & b \\\\"
+      print "    \\end{tabular}"
+      print "caption:"
+      print "    Multi line"
+      print "    caption " i
+      print ""
+    }
+  }'
+}
+
+# Streaming emission vs. building the --ir node array first.
+bench_ir() {
+  local doc="$BENCH_DIR/mixed.itex"
+  gen_mixed_doc 50000 > "$doc"
+  echo "== ir: $(wc -l < "$doc") lines, $(($(wc -c < "$doc") / 1024)) KB"
+  "$EL" --stats "$doc" > "$BENCH_DIR/mixed.stream.tex"
+  "$EL" --ir --stats "$doc" > "$BENCH_DIR/mixed.ir.tex"
+  cmp -s "$BENCH_DIR/mixed.stream.tex" "$BENCH_DIR/mixed.ir.tex" \
+    && echo "   outputs identical" \
+    || { echo "   outputs differ"; exit 1; }
+}
+
+# A framed --lsp session: open the document, then apply $2 one-character
+# edits spread through it.
+gen_lsp_session() {
+  LC_ALL=C awk -v edits="$2" '
+    function send(body) { printf "Content-Length: %d\r\n\r\n%s", length(body), body }
+    {
+      gsub(/\\/, "\\\\"); gsub(/"/, "\\\""); gsub(/\t/, "\\t")
+      line_at[NR] = $0; total += length($0) + (NR > 1 ? 2 : 0)
+    }
+    END {
+      head = "{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":{\"uri\":\"file:///b.itex\",\"text\":\""
+      tail = "\"}}}"
+      printf "Content-Length: %d\r\n\r\n%s", length(head) + total + length(tail), head
+      for (i = 1; i <= NR; i++) printf "%s%s", (i > 1 ? "\\n" : ""), line_at[i]
+      printf "%s", tail
+      for (i = 0; i < edits; i++) {
+        line = int((NR - 1) * i / (edits ? edits : 1))
+        send("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":{\"uri\":\"file:///b.itex\"},\"contentChanges\":[{\"range\":{\"start\":{\"line\":" line ",\"character\":0},\"end\":{\"line\":" line ",\"character\":0}},\"text\":\" \"}]}}")
+      }
+      send("{\"jsonrpc\":\"2.0\",\"id\":1,\"method\":\"shutdown\"}")
+      send("{\"jsonrpc\":\"2.0\",\"method\":\"exit\"}")
+    }' "$1"
+}
+
+# Per-edit cost of the language server; should not grow with document size.
+bench_lsp() {
+  local n edits=500
+  for n in 2000 20000; do
+    local doc="$BENCH_DIR/lsp.$n.itex"
+    gen_mixed_doc "$n" > "$doc"
+    gen_lsp_session "$doc" 0 > "$BENCH_DIR/lsp.open.in"
+    gen_lsp_session "$doc" "$edits" > "$BENCH_DIR/lsp.edit.in"
+    local t0 t1 t2
+    t0=$(date +%s%N)
+    "$EL" --lsp < "$BENCH_DIR/lsp.open.in" > /dev/null
+    t1=$(date +%s%N)
+    "$EL" --lsp < "$BENCH_DIR/lsp.edit.in" > /dev/null
+    t2=$(date +%s%N)
+    echo "== lsp: $(wc -l < "$doc") lines: open $(( (t1 - t0) / 1000000 )) ms," \
+         "$(( ((t2 - t1) - (t1 - t0)) / edits / 1000 )) us/edit"
+  done
+}
+
+# 500 inline {{py: ...}} values (one interpreter) vs. python: blocks (one
+# interpreter each).
+bench_inline() {
+  local n=500 blocks=20
+  awk -v n="$n" 'BEGIN {
+    print "python:"; print "    base = 7"
+    for (i = 0; i < n; i++) print "Value " i " is {{py: base * " i "}}."
+  }' > "$BENCH_DIR/inline.itex"
+  awk -v n="$blocks" 'BEGIN {
+    for (i = 0; i < n; i++) { print "python:"; print "    print(7 * " i ")" }
+  }' > "$BENCH_DIR/blocks.itex"
+  local t0 t1 t2
+  t0=$(date +%s%N)
+  "$EL" "$BENCH_DIR/inline.itex" > "$BENCH_DIR/inline.tex"
+  t1=$(date +%s%N)
+  "$EL" "$BENCH_DIR/blocks.itex" > "$BENCH_DIR/blocks.tex"
+  t2=$(date +%s%N)
+  echo "== inline: $n values in $(( (t1 - t0) / 1000000 )) ms;" \
+       "$blocks python: blocks in $(( (t2 - t1) / 1000000 )) ms"
+}
+
+# A ~50 MB pgfplots coordinate table inside latex:. The streaming front end
+# passes it through from the mapped input; --ir copies it line by line.
+bench_raw() {
+  local doc="$BENCH_DIR/tikz.itex"
+  awk 'BEGIN {
+    print "section: Plot"
+    print "latex:"
+    print "    \\begin{tikzpicture}"
+    print "    \\begin{axis}"
+    print "    \\addplot coordinates {"
+    for (i = 0; i < 2000000; i++) printf "        (%d.%03d, %d.%06d)\n", i, i % 1000, i * 7 % 9973, i % 999983
+    print "    };"
+    print "    \\end{axis}"
+    print "    \\end{tikzpicture}"
+    print "Done."
+  }' > "$doc"
+  echo "== raw: $(($(wc -c < "$doc") / 1048576)) MB latex: block"
+  "$EL" --stats "$doc" > "$BENCH_DIR/tikz.stream.tex"
+  "$EL" --ir --stats "$doc" > "$BENCH_DIR/tikz.ir.tex"
+  cmp -s "$BENCH_DIR/tikz.stream.tex" "$BENCH_DIR/tikz.ir.tex" \
+    && echo "   outputs identical" \
+    || { echo "   outputs differ"; exit 1; }
+}
+
+# Adversarial inputs. Every case runs at a base size and at 4x the input
+# bytes, through the streaming, --ir and --check front ends. It fails
+# (exit 1) if the time grows more than 6x (linear is 4x, quadratic 16x) or
+# the peak RSS at the large size exceeds the budget: PCT% of the input size
+# + 32 MB, where --ir gets IR_PCT% because its arena holds the document.
+# Nesting depth costs indentation, so depth d needs ~d^2/2 bytes: 20k levels
+# is already 200 MB, and 1M levels cannot be written down at all.
+gen_guard_nest()  { awk -v d="$1" 'BEGIN { s = ""; for (i = 0; i < d; i++) { print s "itemize:"; s = s " " } }'; }
+gen_guard_line()  { head -c "$1" /dev/zero | tr '\0' 'a'; echo; }
+gen_guard_brackets() { printf 'a'; head -c "$1" /dev/zero | tr '\0' '['; printf ': x\n'; }
+gen_guard_math()  { awk -v n="$1" 'BEGIN { printf "math:\n    "; for (i = 0; i < n; i++) printf "x\\n"; print "" }'; }
+
+# Prints "seconds rss_kb" from a --stats line.
+guard_measure() {
+  "$EL" --stats "$@" 2>&1 >/dev/null | awk '
+    /peak RSS/ {
+      for (i = 1; i <= NF; i++) {
+        if ($(i + 1) == "s," || $(i + 1) == "s") t += $i
+        if ($i == "RSS") rss = $(i + 1)
+      }
+    }
+    END { print t, rss }'
+}
+
+GUARD_FAIL=0
+guard_case() {
+  local name="$1" n="$2" big="$3" pct="$4" ir_pct="$5"
+  local small_doc="$BENCH_DIR/guard.$name.1.itex" big_doc="$BENCH_DIR/guard.$name.4.itex"
+  "gen_guard_$name" "$n" > "$small_doc"
+  "gen_guard_$name" "$big" > "$big_doc"
+  local in_kb=$(( $(wc -c < "$big_doc") / 1024 ))
+  local mode budget
+  for mode in "" --ir --check; do
+    budget=$(( in_kb * $([ "$mode" = --ir ] && echo "$ir_pct" || echo "$pct") / 100 + 32768 ))
+    read -r t1 _ <<< "$(guard_measure $mode "$small_doc")"
+    read -r t4 rss <<< "$(guard_measure $mode "$big_doc")"
+    local verdict
+    verdict=$(awk -v a="$t1" -v b="$t4" -v r="$rss" -v m="$budget" 'BEGIN {
+      if (a < 0.02) a = 0.02
+      ratio = b / a
+      printf "%5.2fx %s, %d KB %s", ratio, (ratio <= 6 ? "ok" : "TOO SLOW"), r, (r <= m ? "ok" : "OVER BUDGET")
+      exit (ratio <= 6 && r <= m) ? 0 : 1
+    }') || GUARD_FAIL=1
+    printf "   %-9s %-8s %6.3f s -> %6.3f s  %s (budget %d KB)\n" "$name" "${mode:-stream}" "$t1" "$t4" "$verdict" "$budget"
+  done
+}
+
+bench_guard() {
+  echo "== guard: adversarial inputs (time ratio for 4x input, peak RSS)"
+  #          name     base     4x bytes   pct ir_pct
+  guard_case nest     10000    20000      0   110
+  guard_case line     25000000 100000000  150 150
+  guard_case brackets 25000000 100000000  150 150
+  guard_case math     250000   1000000    0   110
+  [ "$GUARD_FAIL" -eq 0 ] || { echo "   guard budgets exceeded"; exit 1; }
+}
+
+# Block stack cost: peak RSS per nesting level (20k vs. 1k levels deep) and
+# open/close throughput on a sawtooth outline up to 32 blocks deep.
+gen_sawtooth() {
+  awk -v n="$1" 'BEGIN {
+    split("center quote itemize theorem proof minipage", env, " ")
+    for (i = 0; i < n; i++) {
+      d = i % 32
+      printf "%" (d + 1) "s%s:\n", "", env[i % 6 + 1]
+      if (d == 31) printf "%" (d + 2) "s%s\n", "", "leaf text"
+    }
+  }' | sed 's/^ //'
+}
+
+# BLOCKS_BASE: revision to compare against, by default the last one whose
+# Block carried every kind's fields (before the tagged union).
+bench_blocks() {
+  gen_guard_nest 1000 > "$BENCH_DIR/blocks.1k.itex"
+  gen_guard_nest 20000 > "$BENCH_DIR/blocks.20k.itex"
+  gen_sawtooth 2000000 > "$BENCH_DIR/sawtooth.itex"
+  local base=${BLOCKS_BASE:-4a9bfd8^} bins=("$EL") labels=(current) k r1 r20 t
+  if git show "$base:easylatex.c" > "$BENCH_DIR/blocks.base.c" 2>/dev/null &&
+     gcc -O2 -std=c11 -w "$BENCH_DIR/blocks.base.c" -o "$BENCH_DIR/easylatex.base"; then
+    bins=("$BENCH_DIR/easylatex.base" "$EL") labels=("$base" current)
+  else
+    echo "   (no baseline: cannot build $base)"
+  fi
+  echo "== blocks:"
+  for k in "${!bins[@]}"; do
+    local EL=${bins[$k]}
+    read -r _ r1 <<< "$(guard_measure "$BENCH_DIR/blocks.1k.itex")"
+    read -r _ r20 <<< "$(guard_measure "$BENCH_DIR/blocks.20k.itex")"
+    read -r t _ <<< "$(guard_measure "$BENCH_DIR/sawtooth.itex")"
+    echo "   ${labels[$k]}: $(( (r20 - r1) * 1024 / 19000 )) bytes/level;" \
+         "2M opens+closes in $t s ($(awk -v t="$t" 'BEGIN { printf "%.1f", 2 / t }') M/s)"
+  done
+}
+
+# Three outputs of a document with 10 python: blocks: three plain runs (each
+# starts its own interpreters) vs. one run with three --variant outputs.
+bench_variants() {
+  local doc="$BENCH_DIR/variants.itex"
+  {
+    gen_mixed_doc 5000
+    awk 'BEGIN {
+      for (i = 0; i < 10; i++) {
+        print "only[" (i % 2 ? "appendix" : "!draft") "]:"
+        print "    python:"
+        print "        print(sum(range(" i " * 1000)))"
+      }
+    }'
+  } > "$doc"
+  # Same work both ways: one --variant run per variant, then all at once.
+  local specs=(full:tags=appendix draft:spacing=2 short:) args=() t0 t1 t2 s v o
+  t0=$(date +%s%N)
+  for s in "${specs[@]}"; do
+    v=${s%%:*} o=${s#*:}
+    "$EL" --variant "$v=out=$BENCH_DIR/variants.$v.sep.tex${o:+,$o}" "$doc"
+  done
+  t1=$(date +%s%N)
+  for s in "${specs[@]}"; do
+    v=${s%%:*} o=${s#*:}
+    args+=(--variant "$v=out=$BENCH_DIR/variants.$v.one.tex${o:+,$o}")
+  done
+  "$EL" --stats "${args[@]}" "$doc" 2> "$BENCH_DIR/variants.stats"
+  t2=$(date +%s%N)
+  echo "== variants: ${#specs[@]} single-variant runs $(( (t1 - t0) / 1000000 )) ms;" \
+       "one run with ${#specs[@]} variants $(( (t2 - t1) / 1000000 )) ms"
+  for s in "${specs[@]}"; do
+    v=${s%%:*}
+    cmp -s "$BENCH_DIR/variants.$v.sep.tex" "$BENCH_DIR/variants.$v.one.tex" \
+      || { echo "   outputs differ for $v"; exit 1; }
+  done
+  sed 's/^easylatex: /   /' "$BENCH_DIR/variants.stats"
+}
+
+CASES=("$@")
+[ ${#CASES[@]} -eq 0 ] && CASES=(ir lsp inline raw guard blocks variants)
+for c in "${CASES[@]}"; do
+  "bench_$c"
+done
@@ -1,8 +1,17 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
 
 #ifndef TAB_WIDTH
 #define TAB_WIDTH 4
@@ -10,22 +19,65 @@
 
 #ifdef _WIN32
   #include <io.h>
+  #include <direct.h>
+  #include <fcntl.h>
   #define popen  _popen
   #define pclose _pclose
+  #define NULL_DEVICE "NUL"
 #else
+  #define NULL_DEVICE "/dev/null"
   #include <unistd.h>
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/resource.h>
+  #include <sys/wait.h>
+  #include <poll.h>
+  #include <signal.h>
+  #include <sys/uio.h>
+  #ifdef __linux__
+    #include <sys/prctl.h>
+  #endif
 #endif
 
-typedef enum { BLK_ENV, BLK_MATH, BLK_PYTHON, BLK_RAW } BlockKind;
+typedef enum { BLK_ENV, BLK_MATH, BLK_PYTHON, BLK_RAW, BLK_ONLY } BlockKind;
 typedef enum { PYRES_VERBATIM, PYRES_TEX } PyResultsMode;
 
+/* Limits for one python: block; 0 means unlimited. */
+typedef struct { long timeout_ms; unsigned long long mem_bytes; } PyLimits;
+
 typedef struct { char *data; size_t len; size_t cap; } StrBuf;
 
-static void die(const char *msg){ fprintf(stderr,"easylatex: %s\n",msg); exit(1); }
+/* stdout/stderr saved while output is silenced (see quiet_output). */
+static int g_saved_fds[2]={-1,-1};
+
+static void die(const char *msg){
+  if(g_saved_fds[1]>=0){ fflush(stderr); dup2(g_saved_fds[1],2); }
+  fprintf(stderr,"easylatex: %s\n",msg);
+  exit(1);
+}
 static void *xmalloc(size_t n){ void *p=malloc(n); if(!p) die("out of memory"); return p; }
 static void *xrealloc(void *p,size_t n){ void *q=realloc(p,n); if(!q) die("out of memory"); return q; }
 static char *xstrdup(const char *s){ size_t n=strlen(s)+1; char *p=(char*)xmalloc(n); memcpy(p,s,n); return p; }
 
+/* Timing and memory figures for --stats. */
+static double now_seconds(void){
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec*1e-9;
+#else
+  return (double)clock()/CLOCKS_PER_SEC;
+#endif
+}
+static long peak_rss_kb(void){
+#ifndef _WIN32
+  struct rusage ru;
+  if(getrusage(RUSAGE_SELF, &ru)==0) return ru.ru_maxrss;
+#endif
+  return -1;
+}
+
 static void sb_init(StrBuf *sb){ sb->data=NULL; sb->len=0; sb->cap=0; }
 static void sb_free(StrBuf *sb){ free(sb->data); sb->data=NULL; sb->len=sb->cap=0; }
 static void sb_reserve(StrBuf *sb,size_t need){
@@ -45,22 +97,56 @@ static void sb_append_n(StrBuf *sb,const char *s,size_t n){
 static void sb_append(StrBuf *sb,const char *s){ sb_append_n(sb,s,strlen(s)); }
 static void sb_append_char(StrBuf *sb,char c){ sb_append_n(sb,&c,1); }
 
+typedef enum {
+  HDR_NONE,     /* not a recognized header: the line is plain text */
+  HDR_NOBODY,
+  HDR_BRACED,
+  HDR_TITLE,
+  HDR_CSV,
+  HDR_BIB,
+  HDR_RAW,
+  HDR_MATH,
+  HDR_PYTHON,
+  HDR_ONLY,     /* only[tag]: children apply in matching variants */
+  HDR_ENV
+} HeaderKind;
+
+/* A header keyword (see k_keywords). Environments also carry their
+   `\end{...}` line, so an open block points here instead of copying names. */
 typedef struct {
-  BlockKind kind;
-  int indent_cols;
-
-  char *env_name;
+  const char *name;
+  HeaderKind hdr;
   bool is_list;
+  const char *end_line;
+  size_t end_len;
+} Keyword;
 
-  int  math_base_cols;
-  char *math_pending;
-  bool math_raw_sticky;
-
-  int py_base_cols;
-  PyResultsMode py_mode;
-  StrBuf py_code;
+typedef struct {
+  int base_cols;
+  bool has_pending;
+  bool raw_sticky;
+  StrBuf pending;         /* last row, held back until we know how it ends */
+} MathBody;
 
-  int raw_base_cols;
+typedef struct {
+  int base_cols;
+  PyResultsMode mode;
+  PyLimits limits;
+  uint32_t at;            /* inline python job key, see InlinePy */
+  StrBuf code;
+} PyBody;
+
+/* One open block. `kind` tags the union; math: and python: state lives out
+   of line so deep environment nesting costs 16 bytes a level. */
+typedef struct {
+  BlockKind kind;
+  int indent_cols;
+  union {
+    const Keyword *env;   /* BLK_ENV */
+    int raw_base_cols;    /* BLK_RAW */
+    MathBody *math;       /* BLK_MATH */
+    PyBody *py;           /* BLK_PYTHON */
+  } u;
 } Block;
 
 typedef struct { Block *data; size_t len; size_t cap; } BlockStack;
@@ -77,9 +163,10 @@ static void stack_push(BlockStack *st, Block b){
 static Block *stack_top(BlockStack *st){ return st->len?&st->data[st->len-1]:NULL; }
 static Block stack_pop(BlockStack *st){ if(!st->len) die("internal: pop empty"); return st->data[--st->len]; }
 
+static bool is_rstrip_char(char c){ return c==' '||c=='\t'||c=='\r'||c=='\n'; }
 static void rstrip_inplace(char *s){
   size_t n=strlen(s);
-  while(n>0 && (s[n-1]==' '||s[n-1]=='\t'||s[n-1]=='\r'||s[n-1]=='\n')) s[--n]='\0';
+  while(n>0 && is_rstrip_char(s[n-1])) s[--n]='\0';
 }
 static const char *lskip_spaces(const char *s){ while(*s==' '||*s=='\t') s++; return s; }
 static bool is_blank_line(const char *s){ while(*s){ if(!isspace((unsigned char)*s)) return false; s++; } return true; }
@@ -94,7 +181,8 @@ static char *read_line(FILE *fp){
   size_t cap=256,len=0;
   char *buf=(char*)xmalloc(cap);
   for(;;){
-    if(!fgets(buf+len,(int)(cap-len),fp)){
+    size_t room=cap-len;
+    if(!fgets(buf+len,(room>INT_MAX)?INT_MAX:(int)room,fp)){
       if(len==0){ free(buf); return NULL; }
       return buf;
     }
@@ -115,15 +203,93 @@ static const char *strip_cols(const char *line,int cols_to_strip){
   return line+i;
 }
 
+/* A whole input file in memory: mmap'ed when possible, otherwise read into
+   a heap buffer (pipes, special files, Windows). */
+typedef struct {
+  char *data; size_t len; bool mapped;
+  size_t dropped;   /* leading bytes already unmapped (see raw_passthrough) */
+} MappedFile;
+
+static bool map_file(const char *path, MappedFile *mf){
+  mf->data=NULL; mf->len=0; mf->mapped=false; mf->dropped=0;
+#ifndef _WIN32
+  int fd=open(path,O_RDONLY);
+  if(fd<0) return false;
+  struct stat sbuf;
+  if(fstat(fd,&sbuf)==0 && S_ISREG(sbuf.st_mode)){
+    if(sbuf.st_size==0){ close(fd); return true; }
+    void *p=mmap(NULL,(size_t)sbuf.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    if(p!=MAP_FAILED){
+      posix_madvise(p,(size_t)sbuf.st_size,POSIX_MADV_SEQUENTIAL);
+      mf->data=(char*)p; mf->len=(size_t)sbuf.st_size; mf->mapped=true;
+      close(fd);
+      return true;
+    }
+  }
+  StrBuf sb; sb_init(&sb);
+  char buf[65536];
+  for(;;){
+    ssize_t r=read(fd,buf,sizeof(buf));
+    if(r<0){ if(errno==EINTR) continue; sb_free(&sb); close(fd); return false; }
+    if(r==0) break;
+    sb_append_n(&sb,buf,(size_t)r);
+  }
+  close(fd);
+#else
+  FILE *f=fopen(path,"rb");
+  if(!f) return false;
+  StrBuf sb; sb_init(&sb);
+  char buf[65536]; size_t n;
+  while((n=fread(buf,1,sizeof(buf),f))>0) sb_append_n(&sb,buf,n);
+  fclose(f);
+#endif
+  mf->data=sb.data; mf->len=sb.len;
+  return true;
+}
+static void unmap_file(MappedFile *mf){
+#ifndef _WIN32
+  if(mf->mapped){ munmap(mf->data,mf->len); mf->data=NULL; mf->len=0; return; }
+#endif
+  free(mf->data); mf->data=NULL; mf->len=0;
+}
+
+/* Maps the file behind `fp` if it is a regular file; no read fallback. */
+static bool map_stream(FILE *fp, MappedFile *mf){
+  mf->data=NULL; mf->len=0; mf->mapped=false; mf->dropped=0;
+#ifndef _WIN32
+  struct stat sbuf;
+  int fd=fileno(fp);
+  if(fd<0 || fstat(fd,&sbuf)!=0 || !S_ISREG(sbuf.st_mode) || sbuf.st_size==0) return false;
+  void *p=mmap(NULL,(size_t)sbuf.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  if(p==MAP_FAILED) return false;
+  mf->data=(char*)p; mf->len=(size_t)sbuf.st_size; mf->mapped=true;
+  return true;
+#else
+  (void)fp;
+  return false;
+#endif
+}
+
 static bool streq(const char *a, const char *b){ return strcmp(a,b)==0; }
 
-static bool is_list_env_name(const char *env){
-  return streq(env,"itemize") || streq(env,"enumerate") || streq(env,"description");
+/* Anchored on the last byte, which is rarer than the first for "only". */
+static bool mem_contains(const char *s, size_t n, const char *word){
+  size_t wn=strlen(word);
+  if(n<wn) return false;
+  for(const char *p=s+wn-1, *end=s+n; p<end; p++){
+    p=(const char*)memchr(p,word[wn-1],(size_t)(end-p));
+    if(!p) return false;
+    if(memcmp(p-(wn-1),word,wn)==0) return true;
+  }
+  return false;
 }
+
 static bool inside_list_env(const BlockStack *st){
-  if(!st->len) return false;
-  const Block *top=&st->data[st->len-1];
-  return top->kind==BLK_ENV && top->is_list;
+  size_t i=st->len;
+  while(i && st->data[i-1].kind==BLK_ONLY) i--;
+  if(!i) return false;
+  const Block *top=&st->data[i-1];
+  return top->kind==BLK_ENV && top->u.env->is_list;
 }
 static const char *strip_list_marker(const char *s){
   s=lskip_spaces(s);
@@ -139,204 +305,144 @@ static bool looks_like_command_call(const char *content){
   return (*s=='{'||*s=='[');
 }
 
-static bool is_title_command(const char *name){
-  return streq(name,"part") ||
-         streq(name,"chapter") ||
-         streq(name,"section") ||
-         streq(name,"subsection") ||
-         streq(name,"subsubsection") ||
-         streq(name,"paragraph") ||
-         streq(name,"subparagraph") ||
-         streq(name,"frametitle") ||
-         streq(name,"framesubtitle");
-}
-
-static bool is_braced_command(const char *name){
-  return streq(name,"title") ||
-         streq(name,"subtitle") ||
-         streq(name,"author") ||
-         streq(name,"institute") ||
-         streq(name,"date") ||
-         streq(name,"caption") ||
-         streq(name,"label") ||
-         streq(name,"ref") ||
-         streq(name,"pageref") ||
-         streq(name,"nameref") ||
-         streq(name,"eqref") ||
-         streq(name,"url") ||
-         streq(name,"href") ||
-         streq(name,"emph") ||
-         streq(name,"textbf") ||
-         streq(name,"textit") ||
-         streq(name,"texttt") ||
-         streq(name,"textsc") ||
-         streq(name,"underline") ||
-         streq(name,"textrm") ||
-         streq(name,"textsf") ||
-         streq(name,"textmd") ||
-         streq(name,"textup") ||
-         streq(name,"textsl") ||
-         streq(name,"textnormal") ||
-         streq(name,"textsuperscript") ||
-         streq(name,"textsubscript") ||
-         streq(name,"input") ||
-         streq(name,"include") ||
-         streq(name,"includegraphics");
-}
-
-static bool is_nobody_command(const char *name){
-  return streq(name,"tableofcontents") ||
-         streq(name,"listoffigures") ||
-         streq(name,"listoftables") ||
-         streq(name,"maketitle") ||
-         streq(name,"newpage") ||
-         streq(name,"clearpage") ||
-         streq(name,"cleardoublepage") ||
-         streq(name,"smallskip") ||
-         streq(name,"medskip") ||
-         streq(name,"bigskip") ||
-         streq(name,"linebreak") ||
-         streq(name,"pagebreak") ||
-         streq(name,"nolinebreak") ||
-         streq(name,"nopagebreak") ||
-         streq(name,"pause") ||
-         streq(name,"centering") ||
-         streq(name,"raggedright") ||
-         streq(name,"raggedleft");
-}
-
-static bool is_known_environment(const char *name){
-  return
-    streq(name,"center") ||
-    streq(name,"flushleft") ||
-    streq(name,"flushright") ||
-    streq(name,"quote") ||
-    streq(name,"quotation") ||
-    streq(name,"verse") ||
-    streq(name,"abstract") ||
-    streq(name,"titlepage") ||
-    streq(name,"itemize") ||
-    streq(name,"enumerate") ||
-    streq(name,"description") ||
-    streq(name,"figure") ||
-    streq(name,"figure*") ||
-    streq(name,"table") ||
-    streq(name,"table*") ||
-    streq(name,"tabular") ||
-    streq(name,"tabular*") ||
-    streq(name,"tabularx") ||
-    streq(name,"longtable") ||
-    streq(name,"equation") ||
-    streq(name,"equation*") ||
-    streq(name,"align") ||
-    streq(name,"align*") ||
-    streq(name,"gather") ||
-    streq(name,"gather*") ||
-    streq(name,"multline") ||
-    streq(name,"multline*") ||
-    streq(name,"flalign") ||
-    streq(name,"flalign*") ||
-    streq(name,"split") ||
-    streq(name,"cases") ||
-    streq(name,"theorem") ||
-    streq(name,"lemma") ||
-    streq(name,"proposition") ||
-    streq(name,"corollary") ||
-    streq(name,"claim") ||
-    streq(name,"definition") ||
-    streq(name,"example") ||
-    streq(name,"remark") ||
-    streq(name,"proof") ||
-    streq(name,"thebibliography") ||
-    streq(name,"minipage") ||
-    streq(name,"verbatim") ||
-    streq(name,"lstlisting");
-}
-
-static bool is_recognized_header_name(const char *name){
-  return streq(name,"latex") || streq(name,"math") || streq(name,"python") ||
-         is_title_command(name) || is_braced_command(name) || is_nobody_command(name) ||
-         is_known_environment(name);
+/* Every header keyword and what it opens; looked up through keyword_find. */
+#define KW(n,h)      { n, h, false, NULL, 0 }
+#define KW_ENV(n,l)  { n, HDR_ENV, l, "\\end{" n "}\n", sizeof("\\end{" n "}\n")-1 }
+
+static const Keyword k_keywords[]={
+  KW("latex",HDR_RAW), KW("math",HDR_MATH), KW("python",HDR_PYTHON), KW("csv",HDR_CSV),
+  KW("bibliography",HDR_BIB), KW("only",HDR_ONLY),
+  KW("part",HDR_TITLE), KW("chapter",HDR_TITLE), KW("section",HDR_TITLE), KW("subsection",HDR_TITLE),
+  KW("subsubsection",HDR_TITLE), KW("paragraph",HDR_TITLE), KW("subparagraph",HDR_TITLE), KW("frametitle",HDR_TITLE),
+  KW("framesubtitle",HDR_TITLE),
+  KW("title",HDR_BRACED), KW("subtitle",HDR_BRACED), KW("author",HDR_BRACED), KW("institute",HDR_BRACED),
+  KW("date",HDR_BRACED), KW("caption",HDR_BRACED), KW("label",HDR_BRACED), KW("ref",HDR_BRACED),
+  KW("pageref",HDR_BRACED), KW("nameref",HDR_BRACED), KW("eqref",HDR_BRACED), KW("url",HDR_BRACED),
+  KW("href",HDR_BRACED), KW("emph",HDR_BRACED), KW("textbf",HDR_BRACED), KW("textit",HDR_BRACED),
+  KW("texttt",HDR_BRACED), KW("textsc",HDR_BRACED), KW("underline",HDR_BRACED), KW("textrm",HDR_BRACED),
+  KW("textsf",HDR_BRACED), KW("textmd",HDR_BRACED), KW("textup",HDR_BRACED), KW("textsl",HDR_BRACED),
+  KW("textnormal",HDR_BRACED), KW("textsuperscript",HDR_BRACED), KW("textsubscript",HDR_BRACED), KW("input",HDR_BRACED),
+  KW("include",HDR_BRACED), KW("includegraphics",HDR_BRACED),
+  KW("tableofcontents",HDR_NOBODY), KW("listoffigures",HDR_NOBODY), KW("listoftables",HDR_NOBODY), KW("maketitle",HDR_NOBODY),
+  KW("newpage",HDR_NOBODY), KW("clearpage",HDR_NOBODY), KW("cleardoublepage",HDR_NOBODY), KW("smallskip",HDR_NOBODY),
+  KW("medskip",HDR_NOBODY), KW("bigskip",HDR_NOBODY), KW("linebreak",HDR_NOBODY), KW("pagebreak",HDR_NOBODY),
+  KW("nolinebreak",HDR_NOBODY), KW("nopagebreak",HDR_NOBODY), KW("pause",HDR_NOBODY), KW("centering",HDR_NOBODY),
+  KW("raggedright",HDR_NOBODY), KW("raggedleft",HDR_NOBODY),
+  KW_ENV("center",false), KW_ENV("flushleft",false), KW_ENV("flushright",false),
+  KW_ENV("quote",false), KW_ENV("quotation",false), KW_ENV("verse",false),
+  KW_ENV("abstract",false), KW_ENV("titlepage",false), KW_ENV("itemize",true),
+  KW_ENV("enumerate",true), KW_ENV("description",true), KW_ENV("figure",false),
+  KW_ENV("figure*",false), KW_ENV("table",false), KW_ENV("table*",false),
+  KW_ENV("tabular",false), KW_ENV("tabular*",false), KW_ENV("tabularx",false),
+  KW_ENV("longtable",false), KW_ENV("equation",false), KW_ENV("equation*",false),
+  KW_ENV("align",false), KW_ENV("align*",false), KW_ENV("gather",false),
+  KW_ENV("gather*",false), KW_ENV("multline",false), KW_ENV("multline*",false),
+  KW_ENV("flalign",false), KW_ENV("flalign*",false), KW_ENV("split",false),
+  KW_ENV("cases",false), KW_ENV("theorem",false), KW_ENV("lemma",false),
+  KW_ENV("proposition",false), KW_ENV("corollary",false), KW_ENV("claim",false),
+  KW_ENV("definition",false), KW_ENV("example",false), KW_ENV("remark",false),
+  KW_ENV("proof",false), KW_ENV("thebibliography",false), KW_ENV("minipage",false),
+  KW_ENV("verbatim",false), KW_ENV("lstlisting",false),
+};
+
+#undef KW
+#undef KW_ENV
+
+#define KEYWORD_SLOTS 256
+_Static_assert(sizeof(k_keywords)/sizeof(k_keywords[0]) < KEYWORD_SLOTS/2, "grow KEYWORD_SLOTS");
+
+static uint32_t keyword_hash(const char *s){
+  uint32_t h=2166136261u;
+  while(*s){ h^=(unsigned char)*s++; h*=16777619u; }
+  return h;
 }
 
-static bool parse_header(const char *content_in,
-                         char **name_out,
-                         char **args_before_out,
-                         char **inline_after_out)
-{
-  char *tmp = xstrdup(content_in);
-  rstrip_inplace(tmp);
-
-  const char *s0 = lskip_spaces(tmp);
-  if (*s0 == '\0') { free(tmp); return false; }
-
-  if (!(*s0=='_' || isalpha((unsigned char)*s0))) { free(tmp); return false; }
-  const char *p = s0 + 1;
-  while (*p=='_'||isalnum((unsigned char)*p)) p++;
-
-  size_t name_len = (size_t)(p - s0);
-  char *name = (char*)xmalloc(name_len + 1);
-  memcpy(name, s0, name_len);
-  name[name_len] = '\0';
-
-  const char *scan = p;
+/* Open-addressed index into k_keywords, built on first use. Returns NULL
+   for names that are not headers. */
+static const Keyword *keyword_find(const char *name){
+  static uint8_t slots[KEYWORD_SLOTS];   /* k_keywords index + 1; 0 = empty */
+  static bool built=false;
+  if(!built){
+    for(size_t i=0;i<sizeof(k_keywords)/sizeof(k_keywords[0]);i++){
+      uint32_t h=keyword_hash(k_keywords[i].name)&(KEYWORD_SLOTS-1);
+      while(slots[h]) h=(h+1)&(KEYWORD_SLOTS-1);
+      slots[h]=(uint8_t)(i+1);
+    }
+    built=true;
+  }
+  for(uint32_t h=keyword_hash(name)&(KEYWORD_SLOTS-1); slots[h]; h=(h+1)&(KEYWORD_SLOTS-1)){
+    const Keyword *kw=&k_keywords[slots[h]-1];
+    if(streq(kw->name,name)) return kw;
+  }
+  return NULL;
+}
 
+/* Skips the `[...]` / `{...}` argument groups that follow a header name.
+   Returns the first character after them, or NULL when a group is never
+   closed (then *unbalanced, if given, points at its opening bracket). */
+static const char *scan_header_args(const char *scan, const char **unbalanced){
   while (*scan==' ' || *scan=='\t') scan++;
 
   for (;;) {
-    if (*scan == '[') {
+    if (*scan == '[' || *scan == '{') {
+      char open = *scan, close = (open == '[') ? ']' : '}';
+      const char *start = scan;
       int depth = 1;
       scan++;
       while (*scan && depth > 0) {
-        if (*scan == '[') depth++;
-        else if (*scan == ']') depth--;
+        if (*scan == open) depth++;
+        else if (*scan == close) depth--;
         scan++;
       }
-      if (depth != 0) { free(name); free(tmp); return false; }
-      while (*scan==' ' || *scan=='\t') scan++;
-      continue;
-    }
-    if (*scan == '{') {
-      int depth = 1;
-      scan++;
-      while (*scan && depth > 0) {
-        if (*scan == '{') depth++;
-        else if (*scan == '}') depth--;
-        scan++;
+      if (depth != 0) {
+        if (unbalanced) *unbalanced = start;
+        return NULL;
       }
-      if (depth != 0) { free(name); free(tmp); return false; }
       while (*scan==' ' || *scan=='\t') scan++;
       continue;
     }
-    break;
+    return scan;
   }
+}
 
-  if (*scan != ':') {
-    free(name);
-    free(tmp);
-    return false;
-  }
+/* Splits `name[args]{args}: inline` into its three parts (each malloc'd).
+   Works on the caller's line in place: only the parts are copied, so a huge
+   line that is not a header costs no allocation at all. */
+static bool parse_header(const char *content_in,
+                         char **name_out,
+                         char **args_before_out,
+                         char **inline_after_out)
+{
+  const char *s0 = lskip_spaces(content_in);
+  if (!(*s0=='_' || isalpha((unsigned char)*s0))) return false;
+  const char *p = s0 + 1;
+  while (*p=='_'||isalnum((unsigned char)*p)) p++;
+
+  const char *colon = scan_header_args(p, NULL);
+  if (!colon || *colon != ':') return false;
 
-  const char *colon = scan;
+  size_t name_len = (size_t)(p - s0);
+  char *name = (char*)xmalloc(name_len + 1);
+  memcpy(name, s0, name_len);
+  name[name_len] = '\0';
 
-  size_t args_len = (size_t)(colon - p);
-  char *args_raw = (char*)xmalloc(args_len + 1);
-  memcpy(args_raw, p, args_len);
-  args_raw[args_len] = '\0';
-  rstrip_inplace(args_raw);
-  const char *args_trim = lskip_spaces(args_raw);
-  char *args = xstrdup(args_trim);
-  free(args_raw);
+  const char *args = lskip_spaces(p);
+  const char *args_end = colon;
+  while (args_end > args && is_rstrip_char(args_end[-1])) args_end--;
+  char *args_copy = (char*)xmalloc((size_t)(args_end - args) + 1);
+  memcpy(args_copy, args, (size_t)(args_end - args));
+  args_copy[args_end - args] = '\0';
 
-  const char *after = colon + 1;
-  after = lskip_spaces(after);
-  char *inline_after = xstrdup(after);
+  const char *after = lskip_spaces(colon + 1);
+  const char *after_end = after + strlen(after);
+  while (after_end > after && is_rstrip_char(after_end[-1])) after_end--;
+  char *inline_after = (char*)xmalloc((size_t)(after_end - after) + 1);
+  memcpy(inline_after, after, (size_t)(after_end - after));
+  inline_after[after_end - after] = '\0';
 
   *name_out = name;
-  *args_before_out = args;
+  *args_before_out = args_copy;
   *inline_after_out = inline_after;
-
-  free(tmp);
   return true;
 }
 
@@ -357,7 +463,136 @@ static PyResultsMode parse_python_results_mode(const char *args_before){
   return mode;
 }
 
-static char *run_python_and_capture(const char *code){
+/* Looks up `key` in the bracketed option list of a header, e.g. `file` in
+   `csv[file=data.csv, header=true]:`. Keys compare case-insensitively, a
+   bare key reads as "true", and a value wrapped in braces is unwrapped. */
+static bool header_opt(const char *args_before, const char *key, char *val, size_t val_sz){
+  const char *p=strchr(args_before,'[');
+  if(!p) return false;
+  p++;
+  size_t klen=strlen(key);
+  for(;;){
+    p=lskip_spaces(p);
+    const char *item=p;
+    int depth=0;
+    while(*p && !(depth==0 && (*p==','||*p==']'))){
+      if(*p=='{') depth++;
+      else if(*p=='}') depth--;
+      p++;
+    }
+    const char *end=p;
+    const char *eq=item;
+    while(eq<end && *eq!='=') eq++;
+    const char *kend=eq;
+    while(kend>item && (kend[-1]==' '||kend[-1]=='\t')) kend--;
+
+    bool match=((size_t)(kend-item)==klen);
+    for(size_t i=0; match && i<klen; i++){
+      if(tolower((unsigned char)item[i])!=tolower((unsigned char)key[i])) match=false;
+    }
+    if(match){
+      const char *v="true", *vend=v+4;
+      if(eq<end){
+        v=lskip_spaces(eq+1); vend=end;
+        while(vend>v && (vend[-1]==' '||vend[-1]=='\t')) vend--;
+        if(vend-v>=2 && v[0]=='{' && vend[-1]=='}'){ v++; vend--; }
+      }
+      size_t n=(size_t)(vend-v);
+      if(n>=val_sz) n=val_sz-1;
+      memcpy(val,v,n); val[n]='\0';
+      return true;
+    }
+    if(*p!=',') return false;
+    p++;
+  }
+}
+
+static bool opt_is_true(const char *v){
+  return streq(v,"true") || streq(v,"yes") || streq(v,"on") || streq(v,"1");
+}
+
+/* Defaults for python: blocks, set by --timeout / --mem. */
+static PyLimits g_py_limits={0,0};
+
+/* "5s", "500ms", "2m", or plain seconds. */
+static bool parse_duration_ms(const char *s, long *out){
+  char *end;
+  double v=strtod(s,&end);
+  if(end==s || v<0) return false;
+  end=(char*)lskip_spaces(end);
+  double scale=1000.0;
+  if(streq(end,"ms")) scale=1.0;
+  else if(streq(end,"m") || streq(end,"min")) scale=60000.0;
+  else if(streq(end,"h")) scale=3600000.0;
+  else if(!(streq(end,"") || streq(end,"s"))) return false;
+  *out=(long)(v*scale+0.5);
+  return true;
+}
+
+/* "512M", "2G", "64K", or plain bytes. */
+static bool parse_size_bytes(const char *s, unsigned long long *out){
+  char *end;
+  double v=strtod(s,&end);
+  if(end==s || v<0) return false;
+  end=(char*)lskip_spaces(end);
+  double scale=1.0;
+  switch(toupper((unsigned char)end[0])){
+    case '\0': break;
+    case 'K': scale=1024.0; break;
+    case 'M': scale=1024.0*1024.0; break;
+    case 'G': scale=1024.0*1024.0*1024.0; break;
+    default: return false;
+  }
+  if(end[0] && end[1] && !(toupper((unsigned char)end[1])=='B' && !end[2])) return false;
+  *out=(unsigned long long)(v*scale);
+  return true;
+}
+
+static PyLimits parse_python_limits(const char *args_before){
+  PyLimits lim=g_py_limits;
+  char val[64];
+  if(header_opt(args_before,"timeout",val,sizeof(val)) && !parse_duration_ms(val,&lim.timeout_ms)){
+    fprintf(stderr,"easylatex: ignoring bad python timeout '%s'\n", val);
+  }
+  if(header_opt(args_before,"mem",val,sizeof(val)) && !parse_size_bytes(val,&lim.mem_bytes)){
+    fprintf(stderr,"easylatex: ignoring bad python mem limit '%s'\n", val);
+  }
+  return lim;
+}
+
+/* Size of the chunks read from the python child. Output is forwarded as it
+   arrives, so memory stays bounded no matter how much the block prints. */
+#define PY_CHUNK_SIZE (64*1024)
+
+/* Runs `code` with python3 (falling back to python) and streams its combined
+   stdout/stderr to `out`, ending it with a newline. The child is started
+   directly (no shell) under the given limits; a child that outlives its
+   timeout is killed together with anything it spawned. Returns NULL on a
+   normal run, or a message describing why the block was cut short. */
+#ifndef _WIN32
+/* The interpreter runs in its own process group (so a timeout can kill
+   everything it spawned), which takes it out of the terminal's group: a
+   Ctrl-C or a CI cancel only reaches us. Take it down with us. */
+static volatile sig_atomic_t g_py_child=0;
+
+/* The block's script and the empty mkstemp file that reserves its name. */
+static char g_py_files[2][32];
+
+static void py_files_remove(void){
+  for(int i=0;i<2;i++) if(g_py_files[i][0]){ unlink(g_py_files[i]); g_py_files[i][0]='\0'; }
+}
+
+static void kill_python_and_die(int sig){
+  pid_t pid=(pid_t)g_py_child;
+  if(pid>0){ kill(-pid,SIGKILL); kill(pid,SIGKILL); }
+  py_files_remove();
+  signal(sig,SIG_DFL);
+  raise(sig);
+}
+#endif
+
+static const char *run_python_and_stream(const char *code, size_t code_len, PyLimits lim, FILE *out){
+  static char err[256];
   char tmp_path[512];
 
 #ifdef _WIN32
@@ -367,18 +602,28 @@ static char *run_python_and_capture(const char *code){
   FILE *f=fopen(tmp_path,"wb");
   if(!f) die("failed to create temp python file");
 #else
-  char pattern[]="/tmp/easylatex_py_XXXXXX";
-  int fd=mkstemp(pattern);
-  if(fd<0) die("mkstemp failed");
-  snprintf(tmp_path,sizeof(tmp_path),"%s.py",pattern);
-  FILE *f=fopen(tmp_path,"wb");
-  if(!f){ close(fd); die("failed to open temp python file"); }
+  char *reserved=g_py_files[1];
+  snprintf(reserved,sizeof(g_py_files[1]),"/tmp/easylatex_py_XXXXXX");
+  int fd=mkstemp(reserved);
+  if(fd<0){ reserved[0]='\0'; die("mkstemp failed"); }
   close(fd);
+  snprintf(tmp_path,sizeof(tmp_path),"%s.py",reserved);
+  fd=open(tmp_path,O_WRONLY|O_CREAT|O_EXCL,0600);
+  FILE *f=(fd>=0) ? fdopen(fd,"wb") : NULL;
+  if(!f){ if(fd>=0) close(fd); py_files_remove(); die("failed to open temp python file"); }
+  memcpy(g_py_files[0],tmp_path,strlen(tmp_path)+1);
 #endif
 
-  fwrite(code,1,strlen(code),f);
+  fwrite(code,1,code_len,f);
   fclose(f);
 
+  static char buf[PY_CHUNK_SIZE];
+  char last='\n';
+  const char *result=NULL;
+
+#ifdef _WIN32
+  /* No rlimits or process groups here: limits are not enforced. */
+  (void)lim;
   char cmd[1024];
   FILE *pipe=NULL;
   snprintf(cmd,sizeof(cmd),"python3 \"%s\" 2>&1",tmp_path);
@@ -388,17 +633,552 @@ static char *run_python_and_capture(const char *code){
     pipe=popen(cmd,"r");
   }
 
-  StrBuf out; sb_init(&out);
   if(!pipe){
-    sb_append(&out,"ERROR: could not run python (python3/python not found)\n");
+    fputs("ERROR: could not run python (python3/python not found)\n", out);
   } else {
-    char buf[4096];
-    while(fgets(buf,(int)sizeof(buf),pipe)) sb_append(&out,buf);
+    size_t n;
+    while((n=fread(buf,1,sizeof(buf),pipe))>0){
+      fwrite(buf,1,n,out);
+      last=buf[n-1];
+    }
+    if(last!='\n') fputc('\n', out);
     pclose(pipe);
   }
+#else
+  int pfd[2];
+  if(pipe(pfd)<0){ py_files_remove(); die("pipe failed"); }
+  static const int forwarded[]={ SIGINT, SIGTERM, SIGHUP };
+  struct sigaction sa, old_sa[3];
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler=kill_python_and_die;
+  sigemptyset(&sa.sa_mask);
+#ifdef __linux__
+  pid_t parent=getpid();
+#endif
+  pid_t pid=fork();
+  if(pid<0){ py_files_remove(); die("fork failed"); }
+
+  if(pid==0){
+    setpgid(0,0);
+#ifdef __linux__
+    /* Also covers a SIGKILL'd parent, which no handler sees. */
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if(getppid()!=parent) _exit(127);
+#endif
+    /* A background group reading the terminal would stop on SIGTTIN. */
+    int nul=open(NULL_DEVICE,O_RDONLY);
+    if(nul>=0){ dup2(nul,STDIN_FILENO); close(nul); }
+    dup2(pfd[1],STDOUT_FILENO);
+    dup2(pfd[1],STDERR_FILENO);
+    close(pfd[0]); close(pfd[1]);
+    if(lim.mem_bytes){
+      struct rlimit rl={ (rlim_t)lim.mem_bytes, (rlim_t)lim.mem_bytes };
+      setrlimit(RLIMIT_AS,&rl);
+    }
+    execlp("python3","python3",tmp_path,(char*)NULL);
+    execlp("python","python",tmp_path,(char*)NULL);
+    _exit(127);
+  }
+  setpgid(pid,pid);
+  g_py_child=pid;
+  for(int i=0;i<3;i++) sigaction(forwarded[i],&sa,&old_sa[i]);
+  close(pfd[1]);
+
+  double deadline=now_seconds()+lim.timeout_ms/1000.0;
+  bool timed_out=false;
+  size_t total=0;
+  for(;;){
+    if(lim.timeout_ms){
+      double left=deadline-now_seconds();
+      if(left<=0){ timed_out=true; break; }
+      struct pollfd pf={ pfd[0], POLLIN, 0 };
+      int pr=poll(&pf,1,(int)(left*1000.0)+1);
+      if(pr<0){ if(errno==EINTR) continue; break; }
+      if(pr==0) continue;
+    }
+    ssize_t r=read(pfd[0],buf,sizeof(buf));
+    if(r<0){ if(errno==EINTR) continue; break; }
+    if(r==0) break;
+    fwrite(buf,1,(size_t)r,out);
+    last=buf[r-1];
+    total+=(size_t)r;
+  }
+
+  if(timed_out){
+    kill(-pid,SIGKILL);
+    kill(pid,SIGKILL);
+  }
+  close(pfd[0]);
+
+  int status=0;
+  while(waitpid(pid,&status,0)<0 && errno==EINTR){}
+  for(int i=0;i<3;i++) sigaction(forwarded[i],&old_sa[i],NULL);
+  g_py_child=0;
+
+  if(last!='\n') fputc('\n', out);
+
+  if(timed_out){
+    snprintf(err,sizeof(err),"python block timed out after %.3g s and was killed", lim.timeout_ms/1000.0);
+    result=err;
+  } else if(WIFSIGNALED(status)){
+    snprintf(err,sizeof(err),"python block was killed by signal %d", WTERMSIG(status));
+    result=err;
+  } else if(WIFEXITED(status) && WEXITSTATUS(status)==127 && total==0){
+    fputs("ERROR: could not run python (python3/python not found)\n", out);
+  }
+  py_files_remove();
+#endif
 
+#ifdef _WIN32
   remove(tmp_path);
-  return out.data ? out.data : xstrdup("");
+#endif
+  return result;
+}
+
+/* ---- inline python ----------------------------------------------------------
+   `{{py: expr}}` in text, list items and math rows. A document that may have
+   any (its bytes contain "{{py:") is translated twice: a collect pass with
+   output silenced records every python: block and inline expression in emit
+   order, one interpreter runs them all in a shared namespace, and the real
+   pass substitutes the results in that same order. When the collect pass
+   finds no expression after all ("{{py:" in a latex: body or a string), or
+   the document has none, each python: block runs on its own as usual.
+   Jobs are keyed by the IR node they come from (0 in the streaming front
+   end), so a --variant pass that skips an only[...] block skips its jobs. */
+
+typedef enum { INPY_OFF, INPY_COLLECT, INPY_EMIT } InlinePyMode;
+
+typedef struct {
+  char kind;               /* 'b' python: block, 'e' inline expression */
+  uint32_t at;             /* IR node the job comes from */
+  char *src;
+  PyLimits lim;
+  long start, end;         /* block output: byte range in the results file */
+  char *err;               /* NULL when the job ran cleanly */
+  char *value;             /* expression value */
+} PyJob;
+
+typedef struct {
+  InlinePyMode mode;
+  PyJob *jobs; size_t len; size_t cap;
+  size_t next;             /* INPY_EMIT: next job to hand out */
+  uint32_t at;             /* IR node being emitted */
+  FILE *results;
+  char results_path[512];
+} InlinePy;
+
+static InlinePy g_inpy;
+
+static const char k_inpy_driver[]=
+  "import os, sys, signal, traceback\n"
+  "def _easylatex_run(jobs, out_path):\n"
+  "    report = os.dup(1)\n"
+  "    fd = os.open(out_path, os.O_WRONLY | os.O_CREAT | os.O_TRUNC, 0o600)\n"
+  "    os.dup2(fd, 1); os.dup2(fd, 2); os.close(fd)\n"
+  "    class Timeout(BaseException): pass\n"
+  "    def alarm(signum, frame): raise Timeout()\n"
+  "    timers = hasattr(signal, 'setitimer')\n"
+  "    if timers: signal.signal(signal.SIGALRM, alarm)\n"
+  "    ns = {'__name__': '__main__', '__builtins__': __builtins__}\n"
+  "    for kind, src, ms in jobs:\n"
+  "        src = bytes.fromhex(src).decode('utf-8', 'replace')\n"
+  "        err = val = ''\n"
+  "        sys.stdout.flush(); sys.stderr.flush()\n"
+  "        start = os.lseek(1, 0, os.SEEK_CUR)\n"
+  "        try:\n"
+  "            if timers and ms: signal.setitimer(signal.ITIMER_REAL, ms / 1000.0)\n"
+  "            if kind == 'b': exec(compile(src, '<python block>', 'exec'), ns)\n"
+  "            else: val = str(eval(compile(src, '<inline python>', 'eval'), ns))\n"
+  "        except Timeout:\n"
+  "            err = 'timed out after %g s' % (ms / 1000.0)\n"
+  "        except SystemExit as e:\n"
+  "            if isinstance(e.code, str): sys.stderr.write(e.code + '\\n')\n"
+  "        except BaseException:\n"
+  "            t, v, tb = sys.exc_info()\n"
+  "            if kind == 'b': traceback.print_exception(t, v, tb.tb_next)\n"
+  "            else: err = traceback.format_exception_only(t, v)[-1].strip()\n"
+  "        finally:\n"
+  "            if timers: signal.setitimer(signal.ITIMER_REAL, 0)\n"
+  "        sys.stdout.flush(); sys.stderr.flush()\n"
+  "        end = os.lseek(1, 0, os.SEEK_CUR)\n"
+  "        os.write(report, ('%s %d %d %s %s\\n' % (kind, start, end,\n"
+  "            err.encode().hex() or '-', val.encode('utf-8', 'replace').hex() or '-')).encode())\n";
+
+static bool has_inline_py(const char *s, size_t n){
+  for(const char *p=s, *end=s+n; (size_t)(end-p)>=5; p++){
+    p=(const char*)memchr(p,'{',(size_t)(end-p)-4);
+    if(!p) return false;
+    if(memcmp(p,"{{py:",5)==0) return true;
+  }
+  return false;
+}
+
+/* Scans the input for inline expressions and leaves it rewound. Input that
+   cannot seek (a pipe) is spooled to a temp file on the way. */
+static bool input_has_inline_py(FILE **fpp){
+  FILE *fp=*fpp, *spool=NULL;
+  if(fseek(fp,0,SEEK_CUR)!=0){
+    spool=tmpfile();
+    if(!spool) die("cannot create temp file for stdin");
+  }
+  static char buf[65536+4];
+  size_t keep=0;
+  bool found=false;
+  for(;;){
+    size_t n=fread(buf+keep,1,sizeof(buf)-4,fp);
+    if(n==0) break;
+    if(spool && fwrite(buf+keep,1,n,spool)!=n) die("failed to spool stdin");
+    if(!found) found=has_inline_py(buf,keep+n);
+    if(found && !spool) break;
+    size_t have=keep+n;
+    keep=(have<4)?have:4;
+    memmove(buf,buf+have-keep,keep);
+  }
+  if(spool) *fpp=spool;
+  rewind(*fpp);
+  return found;
+}
+
+/* Points stdout and stderr at the null device, or puts them back. */
+static void quiet_output(bool on){
+  fflush(stdout); fflush(stderr);
+  if(on){
+    int nul=open(NULL_DEVICE,O_WRONLY);
+    if(nul<0) die("cannot open " NULL_DEVICE);
+    g_saved_fds[0]=dup(1); g_saved_fds[1]=dup(2);
+    dup2(nul,1); dup2(nul,2);
+    close(nul);
+  } else {
+    dup2(g_saved_fds[0],1); dup2(g_saved_fds[1],2);
+    close(g_saved_fds[0]); close(g_saved_fds[1]);
+    g_saved_fds[0]=g_saved_fds[1]=-1;
+  }
+}
+
+/* Points stdout at `path` (created or truncated), or back at the original
+   stdout when `path` is NULL. */
+static bool output_to(const char *path){
+  static int saved=-1;
+  fflush(stdout);
+  if(!path){
+    if(saved>=0){ dup2(saved,1); close(saved); saved=-1; }
+    return true;
+  }
+  int fd=open(path,O_WRONLY|O_CREAT|O_TRUNC,0666);
+  if(fd<0) return false;
+  if(saved<0) saved=dup(1);
+  dup2(fd,1);
+  close(fd);
+  return true;
+}
+
+static void inpy_add_job(char kind, uint32_t at, const char *src, size_t len, PyLimits lim){
+  if(g_inpy.len==g_inpy.cap){
+    g_inpy.cap=g_inpy.cap?g_inpy.cap*2:32;
+    g_inpy.jobs=(PyJob*)xrealloc(g_inpy.jobs,g_inpy.cap*sizeof(PyJob));
+  }
+  PyJob *j=&g_inpy.jobs[g_inpy.len++];
+  memset(j,0,sizeof(*j));
+  j->kind=kind;
+  j->at=at;
+  j->src=(char*)xmalloc(len+1);
+  memcpy(j->src,src,len); j->src[len]='\0';
+  j->lim=lim;
+  j->start=j->end=-1;
+}
+
+static PyJob *inpy_next_job(char kind, uint32_t at){
+  while(g_inpy.next<g_inpy.len && g_inpy.jobs[g_inpy.next].at<at) g_inpy.next++;
+  if(g_inpy.next>=g_inpy.len || g_inpy.jobs[g_inpy.next].kind!=kind || g_inpy.jobs[g_inpy.next].at!=at){
+    die("inline python: collect and emit passes disagree");
+  }
+  return &g_inpy.jobs[g_inpy.next++];
+}
+
+static void sb_append_hex(StrBuf *sb, const char *s, size_t n){
+  static const char digits[]="0123456789abcdef";
+  char pair[2];
+  for(size_t i=0;i<n;i++){
+    pair[0]=digits[(unsigned char)s[i]>>4];
+    pair[1]=digits[(unsigned char)s[i]&15];
+    sb_append_n(sb,pair,2);
+  }
+}
+
+/* Decodes a hex field of the driver's report; "-" is the empty string. */
+static char *hex_field(const char *s, size_t n){
+  if(n==1 && s[0]=='-') n=0;
+  char *out=(char*)xmalloc(n/2+1);
+  size_t k=0;
+  for(size_t i=0;i+1<n;i+=2){
+    char pair[3]={s[i],s[i+1],0};
+    out[k++]=(char)strtoul(pair,NULL,16);
+  }
+  out[k]='\0';
+  return out;
+}
+
+/* Runs every collected job in one interpreter and reads back its report. */
+static void inpy_run(void){
+  if(g_inpy.len==0) return;
+
+#ifdef _WIN32
+  char *tn=tmpnam(NULL);
+  if(!tn) die("tmpnam failed");
+  snprintf(g_inpy.results_path,sizeof(g_inpy.results_path),"%s.out",tn);
+#else
+  char pattern[]="/tmp/easylatex_pyout_XXXXXX";
+  int fd=mkstemp(pattern);
+  if(fd<0) die("mkstemp failed");
+  close(fd);
+  snprintf(g_inpy.results_path,sizeof(g_inpy.results_path),"%s",pattern);
+#endif
+
+  /* One process means one set of limits: the timeouts add up (each job is
+     also timed on its own inside the driver) and the largest memory limit
+     wins. Any unlimited job lifts the corresponding limit. */
+  PyLimits lim={0,0};
+  bool timed=true, capped=true;
+  StrBuf drv; sb_init(&drv);
+  sb_append(&drv,k_inpy_driver);
+  sb_append(&drv,"_easylatex_run([\n");
+  for(size_t i=0;i<g_inpy.len;i++){
+    const PyJob *j=&g_inpy.jobs[i];
+    char tail[64];
+    sb_append(&drv, j->kind=='b' ? "('b','" : "('e','");
+    sb_append_hex(&drv,j->src,strlen(j->src));
+    snprintf(tail,sizeof(tail),"',%ld),\n",j->lim.timeout_ms);
+    sb_append(&drv,tail);
+    if(j->lim.timeout_ms) lim.timeout_ms+=j->lim.timeout_ms; else timed=false;
+    if(!j->lim.mem_bytes) capped=false;
+    else if(j->lim.mem_bytes>lim.mem_bytes) lim.mem_bytes=j->lim.mem_bytes;
+  }
+  sb_append(&drv,"], bytes.fromhex('");
+  sb_append_hex(&drv,g_inpy.results_path,strlen(g_inpy.results_path));
+  sb_append(&drv,"').decode())\n");
+  lim.timeout_ms=timed ? lim.timeout_ms+5000 : 0;
+  if(!capped) lim.mem_bytes=0;
+
+  FILE *report=tmpfile();
+  if(!report) die("cannot create temp file for python report");
+  const char *err=run_python_and_stream(drv.data,drv.len,lim,report);
+  sb_free(&drv);
+
+  rewind(report);
+  size_t at=0;
+  for(char *line; (line=read_line(report))!=NULL; free(line)){
+    rstrip_inplace(line);
+    char *f[5]; int nf=0;
+    for(char *p=line; nf<5 && *p; ){
+      f[nf++]=p;
+      while(*p && *p!=' ') p++;
+      if(*p) *p++='\0';
+    }
+    if(nf!=5 || at>=g_inpy.len || f[0][0]!=g_inpy.jobs[at].kind || f[0][1]){
+      if(*line) fprintf(stderr,"easylatex: python: %s\n", line);
+      continue;
+    }
+    PyJob *j=&g_inpy.jobs[at++];
+    j->start=strtol(f[1],NULL,10);
+    j->end=strtol(f[2],NULL,10);
+    char *e=hex_field(f[3],strlen(f[3]));
+    if(*e) j->err=e; else free(e);
+    j->value=hex_field(f[4],strlen(f[4]));
+  }
+  fclose(report);
+
+  if(err && strncmp(err,"python block ",13)==0) err+=13;
+  for(; at<g_inpy.len; at++){
+    g_inpy.jobs[at].err=xstrdup(err ? err : "did not run: the interpreter exited early");
+  }
+  g_inpy.results=fopen(g_inpy.results_path,"rb");
+}
+
+static bool inpy_has_exprs(void){
+  for(size_t i=0;i<g_inpy.len;i++) if(g_inpy.jobs[i].kind=='e') return true;
+  return false;
+}
+
+/* Runs each collected python: block in its own interpreter, as a document
+   without inline expressions does, into one results file that several emit
+   passes can read. */
+static void inpy_run_isolated(void){
+#ifdef _WIN32
+  char *tn=tmpnam(NULL);
+  if(!tn) die("tmpnam failed");
+  snprintf(g_inpy.results_path,sizeof(g_inpy.results_path),"%s.out",tn);
+#else
+  char pattern[]="/tmp/easylatex_pyout_XXXXXX";
+  int fd=mkstemp(pattern);
+  if(fd<0) die("mkstemp failed");
+  close(fd);
+  snprintf(g_inpy.results_path,sizeof(g_inpy.results_path),"%s",pattern);
+#endif
+  FILE *f=fopen(g_inpy.results_path,"w+b");
+  if(!f) die("cannot create python results file");
+  for(size_t i=0;i<g_inpy.len;i++){
+    PyJob *j=&g_inpy.jobs[i];
+    j->start=ftell(f);
+    const char *err=run_python_and_stream(j->src,strlen(j->src),j->lim,f);
+    fflush(f);
+    j->end=ftell(f);
+    if(err && strncmp(err,"python block ",13)==0) err+=13;
+    if(err) j->err=xstrdup(err);
+  }
+  g_inpy.results=f;
+}
+
+static void inpy_cleanup(void){
+  if(g_inpy.results) fclose(g_inpy.results);
+  if(g_inpy.results_path[0]) remove(g_inpy.results_path);
+  for(size_t i=0;i<g_inpy.len;i++){
+    free(g_inpy.jobs[i].src); free(g_inpy.jobs[i].err); free(g_inpy.jobs[i].value);
+  }
+  free(g_inpy.jobs);
+  memset(&g_inpy,0,sizeof(g_inpy));
+}
+
+static void inpy_begin_collect(void){
+  quiet_output(true);
+  g_inpy.mode=INPY_COLLECT;
+}
+
+static void inpy_end_collect(void){
+  quiet_output(false);
+  if(!inpy_has_exprs()){
+    inpy_cleanup();
+    return;
+  }
+  inpy_run();
+  g_inpy.mode=INPY_EMIT;
+  g_inpy.next=0;
+}
+
+
+/* `p` points just past "{{py:". Returns the first '}' of the closing "}}",
+   skipping braces and quotes inside the expression, or NULL. */
+static const char *inpy_expr_end(const char *p){
+  int depth=0;
+  char quote=0;
+  for(; *p; p++){
+    if(quote){
+      if(*p=='\\' && p[1]) p++;
+      else if(*p==quote) quote=0;
+    }
+    else if(*p=='\'' || *p=='"') quote=*p;
+    else if(*p=='{') depth++;
+    else if(*p=='}'){
+      if(depth==0) return (p[1]=='}') ? p : NULL;
+      depth--;
+    }
+  }
+  return NULL;
+}
+
+/* Replaces the inline expressions in `s` by their values. The result lives
+   in a buffer reused by the next call. */
+static const char *inpy_expand(const char *s){
+  static StrBuf buf;
+  if(g_inpy.mode==INPY_OFF) return s;
+  const char *p=strstr(s,"{{py:");
+  if(!p) return s;
+
+  buf.len=0;
+  sb_append_n(&buf,"",0);
+  const char *from=s;
+  for(; p; p=strstr(from,"{{py:")){
+    const char *e=inpy_expr_end(p+5);
+    if(!e) break;
+    sb_append_n(&buf,from,(size_t)(p-from));
+
+    const char *x=lskip_spaces(p+5), *xend=e;
+    while(xend>x && (xend[-1]==' '||xend[-1]=='\t')) xend--;
+    if(g_inpy.mode==INPY_COLLECT){
+      inpy_add_job('e',g_inpy.at,x,(size_t)(xend-x),g_py_limits);
+    } else {
+      const PyJob *j=inpy_next_job('e',g_inpy.at);
+      if(j->err){
+        fprintf(stderr,"easylatex: inline python '%s': %s\n", j->src, j->err);
+        sb_append(&buf,"\\textbf{??}");
+      } else {
+        sb_append(&buf,j->value);
+      }
+    }
+    from=e+2;
+  }
+  sb_append(&buf,from);
+  return buf.data;
+}
+
+/* Output of a python: block: run now, or (in the emit pass) copied from the
+   shared interpreter's results. Returns an error message or NULL. */
+static const char *run_python_block(const char *code, size_t code_len, PyLimits lim, uint32_t at){
+  if(g_inpy.mode!=INPY_EMIT) return run_python_and_stream(code,code_len,lim,stdout);
+
+  static char err[256];
+  const PyJob *j=inpy_next_job('b',at);
+  char last='\n';
+  if(g_inpy.results && j->start>=0 && fseek(g_inpy.results,j->start,SEEK_SET)==0){
+    static char buf[PY_CHUNK_SIZE];
+    long left=j->end-j->start;
+    while(left>0){
+      size_t n=fread(buf,1,(left<(long)sizeof(buf))?(size_t)left:sizeof(buf),g_inpy.results);
+      if(n==0) break;
+      fwrite(buf,1,n,stdout);
+      last=buf[n-1];
+      left-=(long)n;
+    }
+  }
+  if(last!='\n') fputc('\n',stdout);
+  if(!j->err) return NULL;
+  snprintf(err,sizeof(err),"python block %s",j->err);
+  return err;
+}
+
+/* ---- --variant ----------------------------------------------------------
+   `--variant name=out=x.tex,spacing=1.5,tags=a+b` (repeatable) writes one
+   output per variant from a single parse: the IR is built once, python jobs
+   run once per distinct set of active only[...] blocks, and each variant is
+   then an emit pass with its own tags and preamble extras. */
+
+typedef struct {
+  char *name;
+  char *out;
+  char *spacing;               /* \setstretch value, or NULL */
+  char **tags; size_t ntags;   /* includes the variant's own name */
+} Variant;
+
+static const Variant *g_variant=NULL;   /* variant being emitted, or NULL */
+static bool g_only_all=false;           /* collect pass: every only[...] applies */
+
+static bool variant_has_tag(const char *tag, size_t n){
+  if(!g_variant) return false;
+  for(size_t i=0;i<g_variant->ntags;i++){
+    if(strlen(g_variant->tags[i])==n && memcmp(g_variant->tags[i],tag,n)==0) return true;
+  }
+  return false;
+}
+
+/* `only[a, !b]:` applies when any listed condition holds; with no --variant
+   no tag is set. A bare `only:` always applies. */
+static bool only_active(const char *args_before){
+  if(g_only_all) return true;
+  const char *p=strchr(args_before,'[');
+  if(!p) return true;
+  const char *end=strchr(p,']');
+  if(!end) return true;
+  for(p++; p<end; ){
+    p=lskip_spaces(p);
+    bool neg=(*p=='!');
+    if(neg) p=lskip_spaces(p+1);
+    const char *q=p;
+    while(q<end && *q!=',') q++;
+    const char *e=q;
+    while(e>p && (e[-1]==' '||e[-1]=='\t')) e--;
+    if(e>p && variant_has_tag(p,(size_t)(e-p))!=neg) return true;
+    p=(q<end) ? q+1 : end;
+  }
+  return false;
 }
 
 static bool g_doc_open=false;
@@ -483,6 +1263,10 @@ static void emit_default_preamble_once(void){
   fputs("\\theoremstyle{remark}\n", stdout);
   fputs("\\newtheorem{remark}[theorem]{Remark}\n", stdout);
 
+  if(g_variant && g_variant->spacing){
+    fprintf(stdout, "\\IfFileExists{setspace.sty}{\\setstretch{%s}}{}\n", g_variant->spacing);
+  }
+
   fputs("\\begin{document}\n", stdout);
   g_doc_open=true;
 }
@@ -494,120 +1278,2374 @@ static void emit_end_document_if_needed(void){
   }
 }
 
-static void fputs_with_n_escapes_inline(const char *s){
-  for(size_t i=0; s[i]; ){
-    if(s[i]=='\\' && s[i+1]=='n'){
-      fputs("\\\\", stdout);
-      i += 2;
-    } else {
-      fputc(s[i], stdout);
-      i++;
-    }
+/* Writes `s` with every literal \n escape replaced by `repl`, in runs. */
+static void fputs_n_escapes(const char *s, const char *repl){
+  for(;;){
+    const char *bs=strchr(s,'\\');
+    while(bs && bs[1]!='n') bs=strchr(bs+1,'\\');
+    if(!bs){ fputs(s, stdout); return; }
+    fwrite(s,1,(size_t)(bs-s),stdout);
+    fputs(repl, stdout);
+    s=bs+2;
   }
 }
 
+static void fputs_with_n_escapes_inline(const char *s){
+  fputs_n_escapes(s, "\\\\");
+}
+
 static void emit_text_with_n_escapes(const char *s){
   emit_default_preamble_once();
-  for(size_t i=0;s[i];){
-    if(s[i]=='\\' && s[i+1]=='n'){ fputs("\\\\\n", stdout); i+=2; }
-    else { fputc(s[i], stdout); i++; }
-  }
+  fputs_n_escapes(inpy_expand(s), "\\\\\n");
   fputc('\n', stdout);
 }
 
-static void math_flush_pending(Block *m){
-  if(m->math_pending){
-    fputs(m->math_pending, stdout);
-    fputc('\n', stdout);
-    free(m->math_pending);
-    m->math_pending=NULL;
-  }
+static void math_put_pending(MathBody *m, const char *ending){
+  fwrite(m->pending.data ? m->pending.data : "", 1, m->pending.len, stdout);
+  fputs(ending, stdout);
+  m->has_pending=false;
 }
-static void math_blank_line(Block *m){
-  if(m->math_pending){
-    fputs(m->math_pending, stdout);
-    fputs(" \\\\[0.6em]\n", stdout);
-    free(m->math_pending);
-    m->math_pending=NULL;
-  }
+static void math_flush_pending(MathBody *m){
+  if(m->has_pending) math_put_pending(m, "\n");
+}
+static void math_blank_line(MathBody *m){
+  if(m->has_pending) math_put_pending(m, " \\\\[0.6em]\n");
 }
-static void math_feed_row(Block *m, const char *row_text){
+/* Each \n escape ends a row; the last row is held back (in a buffer reused
+   across rows) until the next row, a blank line or the block end decides
+   its line ending. */
+static void math_feed_row(MathBody *m, const char *row_text){
   const char *p=row_text;
   while(*p){
-    const char *q=p;
-    while(*q && !(q[0]=='\\' && q[1]=='n')) q++;
-
-    size_t part_len=(size_t)(q-p);
-    char *part=(char*)xmalloc(part_len+1);
-    memcpy(part,p,part_len); part[part_len]='\0';
+    const char *q=strstr(p,"\\n");
+    if(!q) q=p+strlen(p);
 
-    if(m->math_pending){
-      fputs(m->math_pending, stdout);
-      fputs(" \\\\\n", stdout);
-      free(m->math_pending);
-    }
-    m->math_pending=part;
+    if(m->has_pending) math_put_pending(m, " \\\\\n");
+    m->pending.len=0;
+    sb_append_n(&m->pending, p, (size_t)(q-p));
+    m->has_pending=true;
 
     if(*q=='\0') break;
     p=q+2;
   }
 }
 
-static void close_one_block(BlockStack *st){
-  Block b=stack_pop(st);
+/* The input file (NULL for stdin) and stream. Data files named in the
+   document are found relative to the input file; the streaming front end
+   also maps the input stream (a temp file spooled from stdin when it is a
+   pipe) or the file again when a bibliography block needs its citations. */
+static FILE *g_input_fp=NULL;
+static const char *g_input_path=NULL;
 
-  if(b.kind==BLK_ENV){
-    emit_default_preamble_once();
-    fprintf(stdout,"\\end{%s}\n", b.env_name);
-    free(b.env_name);
-    return;
-  }
-  if(b.kind==BLK_RAW){
-    return;
+static bool path_is_absolute(const char *p){
+#ifdef _WIN32
+  if(isalpha((unsigned char)p[0]) && p[1]==':') return true;
+  if(p[0]=='\\') return true;
+#endif
+  return p[0]=='/';
+}
+
+/* `path` as seen from the input file's directory; unchanged when it is
+   absolute or the input is stdin or in the current directory. */
+static void resolve_input_relative(const char *path, char *out, size_t out_sz){
+  const char *slash=g_input_path ? strrchr(g_input_path,'/') : NULL;
+#ifdef _WIN32
+  const char *bslash=g_input_path ? strrchr(g_input_path,'\\') : NULL;
+  if(bslash && (!slash || bslash>slash)) slash=bslash;
+#endif
+  if(!path[0] || path_is_absolute(path) || !slash){ snprintf(out,out_sz,"%s",path); return; }
+  int dir_len=(int)(slash-g_input_path)+1;
+  if(snprintf(out,out_sz,"%.*s%s",dir_len,g_input_path,path)>=(int)out_sz) snprintf(out,out_sz,"%s",path);
+}
+
+/* ---- csv: blocks ---------------------------------------------------------
+   csv[file=data.csv, header=true, cols=lrr, sep=;, env=tabular]:
+   The file is mapped and scanned once; each record becomes a table row with
+   TeX specials escaped. Rows are batched into a buffer and written in large
+   chunks, so a million-row table never goes through per-cell stdio calls. */
+
+#define CSV_FLUSH_SIZE (256*1024)
+
+static const bool k_tex_special[256]={
+  ['&']=true, ['%']=true, ['$']=true, ['#']=true, ['_']=true, ['{']=true,
+  ['}']=true, ['~']=true, ['^']=true, ['\\']=true, ['\r']=true, ['\n']=true,
+};
+
+static void tex_escape_char(StrBuf *out, char c){
+  switch(c){
+    case '~':  sb_append_n(out,"\\textasciitilde{}",17); break;
+    case '^':  sb_append_n(out,"\\textasciicircum{}",18); break;
+    case '\\': sb_append_n(out,"\\textbackslash{}",16); break;
+    case '\r': break;
+    case '\n': sb_append_char(out,' '); break;
+    default:   sb_append_char(out,'\\'); sb_append_char(out,c); break;
+  }
+}
+
+/* Appends the field at *pos (quoted or bare) to `out`, escaped, and steps
+   past its terminator. Returns `sep`, '\n', or 0 at end of data. */
+static int csv_emit_field(const char *d, size_t len, size_t *pos, char sep, StrBuf *out){
+  size_t i=*pos;
+  if(i<len && d[i]=='"'){
+    i++;
+    for(;;){
+      size_t run=i;
+      while(i<len && d[i]!='"' && !k_tex_special[(unsigned char)d[i]]) i++;
+      if(i>run) sb_append_n(out,d+run,i-run);
+      if(i>=len) break;
+      if(d[i]=='"'){
+        if(i+1<len && d[i+1]=='"'){ sb_append_char(out,'"'); i+=2; continue; }
+        i++;
+        break;
+      }
+      tex_escape_char(out,d[i]);
+      i++;
+    }
+    while(i<len && d[i]!=sep && d[i]!='\n') i++;
+  } else {
+    for(;;){
+      size_t run=i;
+      while(i<len && d[i]!=sep && !k_tex_special[(unsigned char)d[i]]) i++;
+      if(i>run) sb_append_n(out,d+run,i-run);
+      if(i>=len || d[i]==sep || d[i]=='\n') break;
+      tex_escape_char(out,d[i]);
+      i++;
+    }
+  }
+  int end=0;
+  if(i<len){ end=(unsigned char)d[i]; i++; }
+  *pos=i;
+  return end;
+}
+
+static size_t csv_count_fields(const char *d, size_t len, char sep){
+  size_t n=1;
+  bool quoted=false;
+  for(size_t i=0;i<len;i++){
+    if(d[i]=='"') quoted=!quoted;
+    else if(!quoted && d[i]==sep) n++;
+    else if(!quoted && d[i]=='\n') break;
+  }
+  return n;
+}
+
+static void emit_csv_table(const char *args_before, const char *inline_after){
+  char given[1024], path[1100], val[256], env[64], cols[512];
+  given[0]='\0';
+  if(!header_opt(args_before,"file",given,sizeof(given))){
+    snprintf(given,sizeof(given),"%s",inline_after);
+  }
+  resolve_input_relative(given,path,sizeof(path));
+  bool header=header_opt(args_before,"header",val,sizeof(val)) && opt_is_true(val);
+  char sep=',';
+  if(header_opt(args_before,"sep",val,sizeof(val)) && val[0]){
+    sep=(streq(val,"tab")||streq(val,"\\t"))?'\t':val[0];
+  }
+  if(!header_opt(args_before,"env",env,sizeof(env)) || !env[0]) snprintf(env,sizeof(env),"longtable");
+  bool longtable=streq(env,"longtable");
+
+  emit_default_preamble_once();
+
+  MappedFile mf;
+  if(!path[0] || !map_file(path,&mf)){
+    fprintf(stderr,"easylatex: cannot open csv file '%s'\n", path);
+    fprintf(stdout,"%% easylatex: cannot open csv file '%s'\n", path);
+    return;
+  }
+  const char *d=mf.data;
+  size_t len=mf.len;
+
+  if(!header_opt(args_before,"cols",cols,sizeof(cols)) || !cols[0]){
+    size_t n=csv_count_fields(d,len,sep);
+    if(n>=sizeof(cols)) n=sizeof(cols)-1;
+    memset(cols,'l',n); cols[n]='\0';
+  }
+
+  StrBuf out; sb_init(&out);
+  sb_reserve(&out,CSV_FLUSH_SIZE+4096);
+  sb_append(&out,"\\begin{"); sb_append(&out,env); sb_append(&out,"}{");
+  sb_append(&out,cols); sb_append(&out,"}\n\\toprule\n");
+
+  bool first=true;
+  size_t pos=0;
+  while(pos<len){
+    if(d[pos]=='\n'){ pos++; continue; }
+    if(d[pos]=='\r' && pos+1<len && d[pos+1]=='\n'){ pos+=2; continue; }
+
+    int end;
+    bool cell=false;
+    do {
+      if(cell) sb_append_n(&out," & ",3);
+      end=csv_emit_field(d,len,&pos,sep,&out);
+      cell=true;
+    } while(end==(unsigned char)sep);
+    sb_append_n(&out," \\\\\n",4);
+
+    if(first && header){
+      sb_append(&out, longtable ? "\\midrule\n\\endhead\n" : "\\midrule\n");
+    }
+    first=false;
+
+    if(out.len>=CSV_FLUSH_SIZE){ fwrite(out.data,1,out.len,stdout); out.len=0; }
+  }
+
+  sb_append(&out,"\\bottomrule\n\\end{"); sb_append(&out,env); sb_append(&out,"}\n");
+  fwrite(out.data,1,out.len,stdout);
+
+  sb_free(&out);
+  unmap_file(&mf);
+}
+
+/* ---- bibliography: blocks -------------------------------------------------
+   bibliography[file=refs.bib, style=plain|unsrt|alpha]:
+   Collects the keys cited anywhere in the document, looks them up in an
+   index of the .bib file and emits only those entries as a thebibliography
+   environment, so no bibtex/biber pass is needed. The index (entries sorted
+   by key, as offsets into the .bib) is cached in .easylatex_cache/ under a
+   hash of the .bib contents; a warm build maps it and binary-searches.
+   The cache header repeats the .bib's length and mtime, and every record
+   is bounds-checked before the cache is trusted. */
+
+#define BIB_CACHE_DIR   ".easylatex_cache"
+#define BIB_CACHE_MAGIC "ELBIBX02"
+#define BIB_CACHE_HDR   32   /* magic, .bib length, .bib mtime, record count */
+
+typedef struct { const char *p; size_t n; } Slice;
+
+typedef struct {
+  Slice *data; size_t len; size_t cap;
+  uint32_t *slots; size_t nslots;  /* open-addressing set: index+1, 0 = empty */
+  bool all;                        /* \nocite{*} */
+} CiteKeys;
+
+typedef struct { uint32_t key_off, key_len, off, len; } BibRec;
+
+typedef struct { Slice name; size_t value_off; } BibMacro;
+
+typedef struct {
+  MappedFile bib;
+  MappedFile cache;
+  BibRec *recs; size_t n;
+  bool recs_owned;
+  BibMacro *macros; size_t nmacros;  /* @string definitions, loaded on first use */
+  bool macros_loaded;
+} BibIndex;
+
+static uint64_t hash_bytes(const char *d, size_t n){
+  uint64_t h=1469598103934665603ULL;
+  size_t i=0;
+  for(; i+8<=n; i+=8){
+    uint64_t w; memcpy(&w,d+i,8);
+    h=(h^w)*1099511628211ULL;
+    h^=h>>29;
+  }
+  for(; i<n; i++) h=(h^(unsigned char)d[i])*1099511628211ULL;
+  return h;
+}
+
+static bool slice_eq(Slice a, Slice b){ return a.n==b.n && memcmp(a.p,b.p,a.n)==0; }
+static bool ci_eq_n(const char *a, const char *b, size_t n){
+  for(size_t i=0;i<n;i++) if(tolower((unsigned char)a[i])!=tolower((unsigned char)b[i])) return false;
+  return true;
+}
+static bool ci_word_eq(const char *p, size_t n, const char *word){
+  if(strlen(word)!=n) return false;
+  for(size_t i=0;i<n;i++) if(tolower((unsigned char)p[i])!=word[i]) return false;
+  return true;
+}
+
+static void cite_add(CiteKeys *ck, const char *p, size_t n){
+  while(n && (*p==' '||*p=='\t')){ p++; n--; }
+  while(n && (p[n-1]==' '||p[n-1]=='\t')) n--;
+  if(!n) return;
+  if(n==1 && *p=='*'){ ck->all=true; return; }
+
+  if((ck->len+1)*2>ck->nslots){
+    size_t ns=ck->nslots?ck->nslots*2:64;
+    uint32_t *slots=(uint32_t*)xmalloc(ns*sizeof(uint32_t));
+    memset(slots,0,ns*sizeof(uint32_t));
+    for(size_t i=0;i<ck->len;i++){
+      size_t h=(size_t)hash_bytes(ck->data[i].p,ck->data[i].n)&(ns-1);
+      while(slots[h]) h=(h+1)&(ns-1);
+      slots[h]=(uint32_t)(i+1);
+    }
+    free(ck->slots);
+    ck->slots=slots; ck->nslots=ns;
+  }
+
+  Slice key={p,n};
+  size_t h=(size_t)hash_bytes(p,n)&(ck->nslots-1);
+  while(ck->slots[h]){
+    if(slice_eq(ck->data[ck->slots[h]-1],key)) return;
+    h=(h+1)&(ck->nslots-1);
+  }
+  if(ck->len==ck->cap){
+    ck->cap=ck->cap?ck->cap*2:64;
+    ck->data=(Slice*)xrealloc(ck->data,ck->cap*sizeof(Slice));
+  }
+  ck->data[ck->len++]=key;
+  ck->slots[h]=(uint32_t)ck->len;
+}
+
+/* Prefixes of the cite commands whose names do not start with "cite". */
+static bool cite_prefix_ok(const char *p, size_t n){
+  static const char *const prefixes[]={ "no", "paren", "text", "auto", "foot", "full", "smart", "super" };
+  if(n==0) return true;
+  for(size_t i=0;i<sizeof(prefixes)/sizeof(prefixes[0]);i++){
+    if(strlen(prefixes[i])==n && memcmp(prefixes[i],p,n)==0) return true;
+  }
+  return false;
+}
+
+/* Finds \cite{a,b}, \citep[..]{..}, \nocite{..}, \parencite{..} and the bare
+   cite{..} command-call form at the start of a line, in document order. The
+   command name must start at the backslash (or the line): \excite{..} and
+   recite{..} are not citations, and neither is text after a \\ break. */
+static void collect_cite_keys(const char *d, size_t len, CiteKeys *ck){
+  const char *end=d+len;
+  const char *q=d;
+  while(q<end){
+    q=(const char*)memchr(q,'c',(size_t)(end-q));
+    if(!q || end-q<4) break;
+    if(memcmp(q,"cite",4)!=0){ q++; continue; }
+
+    const char *w=q;
+    while(w>d && isalpha((unsigned char)w[-1])) w--;
+    if(!cite_prefix_ok(w,(size_t)(q-w))){ q+=4; continue; }
+    const char *bs=w;
+    while(bs>d && bs[-1]=='\\') bs--;
+    bool at_cmd=((w-bs)%2==1);
+    if(!at_cmd && bs==w){
+      const char *b=w;
+      while(b>d && (b[-1]==' '||b[-1]=='\t')) b--;
+      at_cmd=(b==d || b[-1]=='\n' || b[-1]=='\0');
+    }
+    if(!at_cmd){ q+=4; continue; }
+
+    const char *r=q+4;
+    while(r<end && isalpha((unsigned char)*r)) r++;
+    if(r<end && *r=='*') r++;
+    for(int k=0; k<2 && r<end && *r=='['; k++){
+      while(r<end && *r!=']' && *r!='\n') r++;
+      if(r<end && *r==']') r++;
+    }
+    if(r>=end || *r!='{'){ q+=4; continue; }
+
+    const char *kstart=++r;
+    while(r<end && *r!='}' && *r!='\n' && *r!='\0'){
+      if(*r==','){ cite_add(ck,kstart,(size_t)(r-kstart)); kstart=r+1; }
+      r++;
+    }
+    if(r<end && *r=='}') cite_add(ck,kstart,(size_t)(r-kstart));
+    q=r;
+  }
+}
+
+static void cite_keys_free(CiteKeys *ck){
+  free(ck->data); free(ck->slots);
+  memset(ck,0,sizeof(*ck));
+}
+
+static const char *g_bib_sort_base;
+static int bib_rec_cmp(const void *a, const void *b){
+  const BibRec *x=(const BibRec*)a, *y=(const BibRec*)b;
+  size_t n=x->key_len<y->key_len?x->key_len:y->key_len;
+  int c=memcmp(g_bib_sort_base+x->key_off, g_bib_sort_base+y->key_off, n);
+  if(c) return c;
+  if(x->key_len!=y->key_len) return x->key_len<y->key_len?-1:1;
+  return x->off<y->off?-1:(x->off>y->off);
+}
+
+/* Offset just past the entry body opened at d[i] ('{' or '('). */
+static size_t bib_skip_group(const char *d, size_t len, size_t i){
+  char open=d[i], close=(open=='(')?')':'}';
+  int depth=0;
+  for(; i<len; i++){
+    if(d[i]==open) depth++;
+    else if(d[i]==close && --depth==0) return i+1;
+  }
+  return len;
+}
+
+static void bib_build_index(BibIndex *ix){
+  const char *d=ix->bib.data;
+  size_t len=ix->bib.len, cap=0;
+  for(size_t i=0;i<len;){
+    const char *at=(const char*)memchr(d+i,'@',len-i);
+    if(!at) break;
+    size_t start=(size_t)(at-d), j=start+1;
+    size_t tstart=j;
+    while(j<len && isalpha((unsigned char)d[j])) j++;
+    size_t tlen=j-tstart;
+    while(j<len && isspace((unsigned char)d[j])) j++;
+    if(j>=len || (d[j]!='{' && d[j]!='(')){ i=start+1; continue; }
+
+    size_t stop=bib_skip_group(d,len,j);
+    bool special=ci_word_eq(d+tstart,tlen,"string") || ci_word_eq(d+tstart,tlen,"comment") ||
+                 ci_word_eq(d+tstart,tlen,"preamble");
+    if(!special){
+      size_t k=j+1;
+      while(k<stop && isspace((unsigned char)d[k])) k++;
+      size_t kstart=k;
+      while(k<stop && d[k]!=',' && !isspace((unsigned char)d[k])) k++;
+      if(k>kstart){
+        if(ix->n==cap){
+          cap=cap?cap*2:1024;
+          ix->recs=(BibRec*)xrealloc(ix->recs,cap*sizeof(BibRec));
+        }
+        BibRec *r=&ix->recs[ix->n++];
+        r->key_off=(uint32_t)kstart; r->key_len=(uint32_t)(k-kstart);
+        r->off=(uint32_t)start; r->len=(uint32_t)(stop-start);
+      }
+    }
+    i=stop;
+  }
+  g_bib_sort_base=d;
+  qsort(ix->recs,ix->n,sizeof(BibRec),bib_rec_cmp);
+  ix->recs_owned=true;
+}
+
+static void bib_cache_path(char *out, size_t out_sz, uint64_t h){
+  snprintf(out,out_sz,"%s/bib-%016llx.idx",BIB_CACHE_DIR,(unsigned long long)h);
+}
+
+/* A cache written for this very .bib: same length and mtime, and no record
+   reaching past the end of the file. */
+static bool bib_cache_valid(const BibIndex *ix, uint64_t mtime){
+  const char *c=ix->cache.data;
+  if(ix->cache.len<BIB_CACHE_HDR || memcmp(c,BIB_CACHE_MAGIC,8)!=0) return false;
+  uint64_t blen, bmtime, n;
+  memcpy(&blen,c+8,8); memcpy(&bmtime,c+16,8); memcpy(&n,c+24,8);
+  if(blen!=ix->bib.len || bmtime!=mtime) return false;
+  if(n>(ix->cache.len-BIB_CACHE_HDR)/sizeof(BibRec) || ix->cache.len!=BIB_CACHE_HDR+n*sizeof(BibRec)) return false;
+  const BibRec *r=(const BibRec*)(const void*)(c+BIB_CACHE_HDR);
+  for(uint64_t i=0;i<n;i++){
+    if((uint64_t)r[i].key_off+r[i].key_len>blen || (uint64_t)r[i].off+r[i].len>blen) return false;
+  }
+  return true;
+}
+
+static bool bib_open(const char *path, BibIndex *ix){
+  memset(ix,0,sizeof(*ix));
+  if(!map_file(path,&ix->bib)) return false;
+  if(ix->bib.len>UINT32_MAX){ unmap_file(&ix->bib); return false; }
+
+  uint64_t mtime=0;
+#ifndef _WIN32
+  struct stat sbuf;
+  if(stat(path,&sbuf)==0) mtime=(uint64_t)sbuf.st_mtime;
+#endif
+
+  char cpath[512];
+  bib_cache_path(cpath,sizeof(cpath),hash_bytes(ix->bib.data,ix->bib.len));
+
+  if(map_file(cpath,&ix->cache) && bib_cache_valid(ix,mtime)){
+    ix->recs=(BibRec*)(void*)(ix->cache.data+BIB_CACHE_HDR);
+    ix->n=(ix->cache.len-BIB_CACHE_HDR)/sizeof(BibRec);
+    return true;
+  }
+  unmap_file(&ix->cache);
+
+  bib_build_index(ix);
+
+#ifdef _WIN32
+  _mkdir(BIB_CACHE_DIR);
+#else
+  mkdir(BIB_CACHE_DIR,0777);
+#endif
+  char tpath[600];
+  snprintf(tpath,sizeof(tpath),"%s.tmp",cpath);
+  FILE *f=fopen(tpath,"wb");
+  if(f){
+    uint64_t hdr[3]={ ix->bib.len, mtime, ix->n };
+    bool ok=fwrite(BIB_CACHE_MAGIC,1,8,f)==8 && fwrite(hdr,8,3,f)==3 &&
+            fwrite(ix->recs,sizeof(BibRec),ix->n,f)==ix->n;
+    ok=(fclose(f)==0) && ok;
+    if(!ok || rename(tpath,cpath)!=0) remove(tpath);
+  }
+  return true;
+}
+
+static void bib_close(BibIndex *ix){
+  if(ix->recs_owned) free(ix->recs);
+  free(ix->macros);
+  unmap_file(&ix->cache);
+  unmap_file(&ix->bib);
+  memset(ix,0,sizeof(*ix));
+}
+
+static const BibRec *bib_lookup(const BibIndex *ix, Slice key){
+  size_t lo=0, hi=ix->n;
+  while(lo<hi){
+    size_t mid=lo+(hi-lo)/2;
+    const BibRec *r=&ix->recs[mid];
+    size_t n=key.n<r->key_len?key.n:r->key_len;
+    int c=memcmp(key.p, ix->bib.data+r->key_off, n);
+    if(!c) c=(key.n<r->key_len)?-1:(key.n>r->key_len);
+    if(c<=0) hi=mid; else lo=mid+1;
+  }
+  if(lo<ix->n){
+    const BibRec *r=&ix->recs[lo];
+    if(r->key_len==key.n && memcmp(key.p,ix->bib.data+r->key_off,key.n)==0) return r;
+  }
+  return NULL;
+}
+
+static void bib_load_macros(BibIndex *ix){
+  const char *d=ix->bib.data;
+  size_t len=ix->bib.len, cap=0;
+  ix->macros_loaded=true;
+  for(size_t i=0;i<len;){
+    const char *at=(const char*)memchr(d+i,'@',len-i);
+    if(!at) break;
+    size_t j=(size_t)(at-d)+1;
+    i=j;
+    if(len-j<6 || !ci_word_eq(d+j,6,"string")) continue;
+    j+=6;
+    while(j<len && isspace((unsigned char)d[j])) j++;
+    if(j>=len || (d[j]!='{' && d[j]!='(')) continue;
+    j++;
+    while(j<len && isspace((unsigned char)d[j])) j++;
+    size_t ns=j;
+    while(j<len && (isalnum((unsigned char)d[j])||d[j]=='_'||d[j]=='-')) j++;
+    size_t ne=j;
+    while(j<len && isspace((unsigned char)d[j])) j++;
+    if(ne==ns || j>=len || d[j]!='=') continue;
+    if(ix->nmacros==cap){
+      cap=cap?cap*2:16;
+      ix->macros=(BibMacro*)xrealloc(ix->macros,cap*sizeof(BibMacro));
+    }
+    ix->macros[ix->nmacros].name.p=d+ns;
+    ix->macros[ix->nmacros].name.n=ne-ns;
+    ix->macros[ix->nmacros].value_off=j+1;
+    ix->nmacros++;
+  }
+}
+
+/* Parses the value starting at e[*pos] (`{..}`, `".."`, a number or macro,
+   possibly joined with `#`) and, if `out` is given, appends it cleaned up:
+   outer delimiters dropped, month macros spelled out, whitespace collapsed. */
+static void bib_value(BibIndex *ix, const char *e, size_t len, size_t *pos, StrBuf *out, int depth){
+  static const char *const months[][2]={
+    {"jan","January"},{"feb","February"},{"mar","March"},{"apr","April"},
+    {"may","May"},{"jun","June"},{"jul","July"},{"aug","August"},
+    {"sep","September"},{"oct","October"},{"nov","November"},{"dec","December"},
+  };
+  size_t j=*pos;
+  size_t before=out?out->len:0;
+  bool space=false;
+  for(;;){
+    while(j<len && isspace((unsigned char)e[j])) j++;
+    if(j>=len) break;
+    size_t vs, ve;
+    const char *month=NULL;
+    if(e[j]=='{'){
+      size_t stop=bib_skip_group(e,len,j);
+      vs=j+1; ve=stop>vs?stop-1:vs; j=stop;
+    } else if(e[j]=='"'){
+      int depth=0;
+      vs=++j;
+      while(j<len && !(e[j]=='"' && depth==0)){ if(e[j]=='{') depth++; else if(e[j]=='}') depth--; j++; }
+      ve=j;
+      if(j<len) j++;
+    } else {
+      vs=j;
+      while(j<len && (isalnum((unsigned char)e[j])||e[j]=='_'||e[j]=='-'||e[j]=='.'||e[j]==':')) j++;
+      ve=j;
+      for(size_t m=0;m<12;m++){
+        if(ci_word_eq(e+vs,ve-vs,months[m][0])){ month=months[m][1]; break; }
+      }
+      if(!month && out && depth<8 && ve>vs && !isdigit((unsigned char)e[vs])){
+        if(!ix->macros_loaded) bib_load_macros(ix);
+        for(size_t m=0;m<ix->nmacros;m++){
+          const BibMacro *bm=&ix->macros[m];
+          if(bm->name.n==ve-vs && ci_eq_n(bm->name.p,e+vs,ve-vs)){
+            if(space && out->len>before) sb_append_char(out,' ');
+            space=false;
+            size_t mp=bm->value_off;
+            bib_value(ix,ix->bib.data,ix->bib.len,&mp,out,depth+1);
+            vs=ve;
+            break;
+          }
+        }
+      }
+    }
+    if(out){
+      if(month){
+        if(space && out->len>before) sb_append_char(out,' ');
+        sb_append(out,month);
+      } else {
+        for(size_t k=vs;k<ve;k++){
+          if(isspace((unsigned char)e[k])){ space=true; continue; }
+          if(space && out->len>before) sb_append_char(out,' ');
+          space=false;
+          sb_append_char(out,e[k]);
+        }
+      }
+    }
+    while(j<len && isspace((unsigned char)e[j])) j++;
+    if(j<len && e[j]=='#'){ j++; continue; }
+    break;
+  }
+  *pos=j;
+}
+
+/* Finds field `name` (lowercase) in the entry text and appends its value. */
+static bool bib_field(BibIndex *ix, const char *e, size_t len, const char *name, StrBuf *out){
+  size_t i=0;
+  while(i<len && e[i]!=',') i++;   /* skip "@type{key" */
+  while(i<len){
+    while(i<len && (isspace((unsigned char)e[i]) || e[i]==',')) i++;
+    size_t fstart=i;
+    while(i<len && (isalnum((unsigned char)e[i])||e[i]=='_'||e[i]=='-')) i++;
+    size_t flen=i-fstart;
+    while(i<len && isspace((unsigned char)e[i])) i++;
+    if(!flen || i>=len || e[i]!='=') return false;
+    i++;
+    bool match=ci_word_eq(e+fstart,flen,name);
+    bib_value(ix,e,len,&i,match?out:NULL,0);
+    if(match){
+      sb_append_n(out,"",0);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Splits a BibTeX name list on top-level " and ". Each name is reported as
+   [start,end) into `names`. */
+static size_t bib_split_names(const char *s, size_t n, Slice *names, size_t max){
+  size_t count=0, start=0;
+  int depth=0;
+  for(size_t i=0;i<=n && count<max;i++){
+    if(i<n && s[i]=='{') depth++;
+    else if(i<n && s[i]=='}') depth--;
+    bool cut=(i==n) || (depth==0 && i+5<=n && strncmp(s+i," and ",5)==0);
+    if(!cut) continue;
+    names[count].p=s+start; names[count].n=i-start; count++;
+    if(i<n){ start=i+5; i+=4; }
+  }
+  return count;
+}
+
+/* Last name of "Last, First" or "First Last". */
+static Slice bib_last_name(Slice name){
+  for(size_t i=0;i<name.n;i++){
+    if(name.p[i]==','){ Slice r={name.p,i}; return r; }
+  }
+  size_t i=name.n;
+  while(i>0 && name.p[i-1]!=' ') i--;
+  Slice r={name.p+i,name.n-i};
+  return r;
+}
+
+static void bib_append_name(StrBuf *out, Slice name){
+  for(size_t i=0;i<name.n;i++){
+    if(name.p[i]==','){
+      const char *first=lskip_spaces(name.p+i+1);
+      sb_append_n(out,first,(size_t)(name.p+name.n-first));
+      sb_append_char(out,' ');
+      sb_append_n(out,name.p,i);
+      return;
+    }
+  }
+  sb_append_n(out,name.p,name.n);
+}
+
+typedef struct {
+  const BibRec *rec;
+  size_t cite_order;
+  char *label;
+  char *sortkey;
+} BibItem;
+
+static int bib_item_cmp_order(const void *a, const void *b){
+  const BibItem *x=(const BibItem*)a, *y=(const BibItem*)b;
+  return x->cite_order<y->cite_order?-1:(x->cite_order>y->cite_order);
+}
+static int bib_item_cmp(const void *a, const void *b){
+  const BibItem *x=(const BibItem*)a, *y=(const BibItem*)b;
+  int c=strcmp(x->sortkey,y->sortkey);
+  if(c) return c;
+  return x->cite_order<y->cite_order?-1:(x->cite_order>y->cite_order);
+}
+
+#define BIB_MAX_NAMES 64
+
+static void bib_item_prepare(BibIndex *ix, BibItem *it, const char *e, size_t len, bool alpha){
+  StrBuf authors; sb_init(&authors);
+  StrBuf year; sb_init(&year);
+  StrBuf title; sb_init(&title);
+  if(!bib_field(ix,e,len,"author",&authors)) bib_field(ix,e,len,"editor",&authors);
+  bib_field(ix,e,len,"year",&year);
+  bib_field(ix,e,len,"title",&title);
+
+  Slice names[BIB_MAX_NAMES];
+  size_t nn=authors.len ? bib_split_names(authors.data,authors.len,names,BIB_MAX_NAMES) : 0;
+
+  StrBuf key; sb_init(&key);
+  if(nn){
+    Slice last=bib_last_name(names[0]);
+    for(size_t i=0;i<last.n;i++){
+      if(isalpha((unsigned char)last.p[i])) sb_append_char(&key,(char)tolower((unsigned char)last.p[i]));
+    }
+  }
+  sb_append_char(&key,'\x01');
+  if(year.len) sb_append(&key,year.data);
+  sb_append_char(&key,'\x01');
+  if(title.len) sb_append(&key,title.data);
+  it->sortkey=key.data?key.data:xstrdup("");
+
+  it->label=NULL;
+  if(alpha){
+    StrBuf lab; sb_init(&lab);
+    if(nn==1){
+      Slice last=bib_last_name(names[0]);
+      int got=0;
+      for(size_t i=0;i<last.n && got<3;i++){
+        if(isalpha((unsigned char)last.p[i])){ sb_append_char(&lab,got?last.p[i]:(char)toupper((unsigned char)last.p[i])); got++; }
+      }
+    } else {
+      for(size_t k=0;k<nn && k<3;k++){
+        Slice last=bib_last_name(names[k]);
+        for(size_t i=0;i<last.n;i++){
+          if(isalpha((unsigned char)last.p[i])){ sb_append_char(&lab,(char)toupper((unsigned char)last.p[i])); break; }
+        }
+      }
+      if(nn>3) sb_append_char(&lab,'+');
+    }
+    if(year.len>=2) sb_append_n(&lab,year.data+year.len-2,2);
+    it->label=lab.data?lab.data:xstrdup("?");
+  }
+
+  sb_free(&authors); sb_free(&year); sb_free(&title);
+}
+
+static void bib_emit_item(BibIndex *ix, const BibItem *it, const char *e, size_t len, Slice key){
+  char type[32];
+  size_t t=1, tn=0;
+  while(t<len && isalpha((unsigned char)e[t]) && tn<sizeof(type)-1) type[tn++]=(char)tolower((unsigned char)e[t++]);
+  type[tn]='\0';
+
+  StrBuf v; sb_init(&v);
+  fputs("\\bibitem", stdout);
+  if(it->label) fprintf(stdout, "[%s]", it->label);
+  fputc('{', stdout); fwrite(key.p,1,key.n,stdout); fputs("}\n", stdout);
+
+  if(bib_field(ix,e,len,"author",&v) || bib_field(ix,e,len,"editor",&v)){
+    Slice names[BIB_MAX_NAMES];
+    size_t nn=bib_split_names(v.data,v.len,names,BIB_MAX_NAMES);
+    StrBuf a; sb_init(&a);
+    for(size_t i=0;i<nn;i++){
+      if(i) sb_append(&a, (i+1==nn) ? (nn>2 ? ", and " : " and ") : ", ");
+      bib_append_name(&a,names[i]);
+    }
+    fputs(a.data?a.data:"", stdout);
+    fputs(".\n", stdout);
+    sb_free(&a);
+  }
+
+  bool book=streq(type,"book");
+  v.len=0;
+  if(bib_field(ix,e,len,"title",&v)){
+    fputs("\\newblock ", stdout);
+    if(book) fprintf(stdout, "\\emph{%s}.\n", v.data);
+    else fprintf(stdout, "%s.\n", v.data);
+  }
+
+  StrBuf where; sb_init(&where);
+  v.len=0;
+  if(bib_field(ix,e,len,"journal",&v)){
+    sb_append(&where,"\\emph{"); sb_append(&where,v.data); sb_append(&where,"}");
+    v.len=0;
+    if(bib_field(ix,e,len,"volume",&v)){ sb_append(&where,", "); sb_append(&where,v.data); }
+    v.len=0;
+    if(bib_field(ix,e,len,"number",&v)){ sb_append(&where,"("); sb_append(&where,v.data); sb_append(&where,")"); }
+    v.len=0;
+    if(bib_field(ix,e,len,"pages",&v)){ sb_append(&where,":"); sb_append(&where,v.data); }
+  } else if(bib_field(ix,e,len,"booktitle",&v)){
+    sb_append(&where,"In \\emph{"); sb_append(&where,v.data); sb_append(&where,"}");
+    v.len=0;
+    if(bib_field(ix,e,len,"pages",&v)){ sb_append(&where,", pages "); sb_append(&where,v.data); }
+  } else {
+    static const char *const sources[]={"publisher","school","institution","organization","howpublished"};
+    for(size_t k=0;k<sizeof(sources)/sizeof(sources[0]);k++){
+      v.len=0;
+      if(bib_field(ix,e,len,sources[k],&v)){ sb_append(&where,v.data); break; }
+    }
+  }
+  v.len=0;
+  if(bib_field(ix,e,len,"year",&v)){
+    if(where.len) sb_append(&where,", ");
+    sb_append(&where,v.data);
+  }
+  if(where.len) fprintf(stdout, "\\newblock %s.\n", where.data);
+
+  v.len=0;
+  if(bib_field(ix,e,len,"note",&v)) fprintf(stdout, "\\newblock %s.\n", v.data);
+
+  sb_free(&where);
+  sb_free(&v);
+}
+
+/* `cites` are the keys cited in the parts of the document being emitted;
+   NULL when the document is not available, which includes every entry. */
+static void emit_bibliography(const char *args_before, const char *inline_after, const CiteKeys *cites){
+  char path[1024], style[32];
+  path[0]='\0';
+  if(!header_opt(args_before,"file",path,sizeof(path))){
+    snprintf(path,sizeof(path),"%s",inline_after);
+  }
+  if(!header_opt(args_before,"style",style,sizeof(style)) || !style[0]) snprintf(style,sizeof(style),"plain");
+  bool unsrt=streq(style,"unsrt"), alpha=streq(style,"alpha");
+
+  emit_default_preamble_once();
+
+  BibIndex ix;
+  if(!path[0] || !bib_open(path,&ix)){
+    fprintf(stderr,"easylatex: cannot open bibliography file '%s'\n", path);
+    fprintf(stdout,"%% easylatex: cannot open bibliography file '%s'\n", path);
+    return;
+  }
+
+  CiteKeys ck; memset(&ck,0,sizeof(ck));
+  if(cites) ck=*cites;
+  else {
+    fprintf(stderr,"easylatex: bibliography: input is not a file, including every entry of '%s'\n", path);
+    ck.all=true;
+  }
+
+  size_t n=0, cap=ck.all ? ix.n : ck.len;
+  BibItem *items=(BibItem*)xmalloc((cap?cap:1)*sizeof(BibItem));
+  if(ck.all){
+    for(size_t i=0;i<ix.n;i++){ items[n].rec=&ix.recs[i]; items[n].cite_order=ix.recs[i].off; n++; }
+  } else {
+    for(size_t i=0;i<ck.len;i++){
+      const BibRec *r=bib_lookup(&ix,ck.data[i]);
+      if(!r){
+        fprintf(stderr,"easylatex: bibliography: no entry for '%.*s' in %s\n", (int)ck.data[i].n, ck.data[i].p, path);
+        continue;
+      }
+      items[n].rec=r; items[n].cite_order=i; n++;
+    }
+  }
+
+  size_t widest=1;
+  for(size_t i=0;i<n;i++){
+    bib_item_prepare(&ix, &items[i], ix.bib.data+items[i].rec->off, items[i].rec->len, alpha);
+    if(items[i].label && strlen(items[i].label)>widest) widest=strlen(items[i].label);
+  }
+  if(!unsrt) qsort(items,n,sizeof(BibItem),bib_item_cmp);
+  else if(ck.all) qsort(items,n,sizeof(BibItem),bib_item_cmp_order);
+
+  /* Widest label: "99" for up to 99 numbered entries, "WWW" for alpha. */
+  char wide[64];
+  size_t w=widest;
+  if(!alpha) for(w=1, widest=n; widest>=10; widest/=10) w++;
+  if(w>sizeof(wide)-1) w=sizeof(wide)-1;
+  memset(wide, alpha?'W':'9', w); wide[w]='\0';
+
+  fprintf(stdout, "\\begin{thebibliography}{%s}\n", wide);
+  for(size_t i=0;i<n;i++){
+    const BibRec *r=items[i].rec;
+    Slice key={ix.bib.data+r->key_off, r->key_len};
+    bib_emit_item(&ix, &items[i], ix.bib.data+r->off, r->len, key);
+    fputc('\n', stdout);
+    free(items[i].label); free(items[i].sortkey);
+  }
+  fputs("\\end{thebibliography}\n", stdout);
+
+  free(items);
+  bib_close(&ix);
+}
+
+static void close_one_block(BlockStack *st){
+  Block b=stack_pop(st);
+
+  if(b.kind==BLK_ENV){
+    emit_default_preamble_once();
+    fwrite(b.u.env->end_line, 1, b.u.env->end_len, stdout);
+    return;
+  }
+  if(b.kind==BLK_RAW || b.kind==BLK_ONLY){
+    return;
+  }
+  if(b.kind==BLK_MATH){
+    math_flush_pending(b.u.math);
+    sb_free(&b.u.math->pending);
+    free(b.u.math);
+    fputs("\\end{aligned}\n\\]\n", stdout);
+    return;
+  }
+  if(b.kind==BLK_PYTHON){
+    PyBody *py=b.u.py;
+    const char *code=py->code.data?py->code.data:"";
+    if(g_inpy.mode==INPY_COLLECT){
+      inpy_add_job('b', py->at, code, py->code.len, py->limits);
+      sb_free(&py->code);
+      free(py);
+      return;
+    }
+
+    emit_default_preamble_once();
+    const char *err;
+    if(py->mode==PYRES_TEX){
+      err=run_python_block(code, py->code.len, py->limits, py->at);
+      if(err) fprintf(stdout, "\\par\\textbf{easylatex: %s}\n", err);
+    } else {
+      fputs("\\begin{verbatim}\n", stdout);
+      err=run_python_block(code, py->code.len, py->limits, py->at);
+      if(err) fprintf(stdout, "easylatex: %s\n", err);
+      fputs("\\end{verbatim}\n", stdout);
+    }
+    if(err) fprintf(stderr, "easylatex: %s\n", err);
+
+    sb_free(&py->code);
+    free(py);
+    return;
+  }
+}
+
+static void close_blocks_for_indent(BlockStack *st, int indent_cols){
+  for(;;){
+    Block *top=stack_top(st);
+    if(!top) break;
+    if(indent_cols <= top->indent_cols) close_one_block(st);
+    else break;
+  }
+}
+
+static HeaderKind classify_header(const char *name){
+  const Keyword *kw=keyword_find(name);
+  return kw ? kw->hdr : HDR_NONE;
+}
+
+/* Emits one line of a latex:/math:/python: body. `line` still carries its
+   indentation; the block's base indent is taken from its first line. */
+static void emit_block_body_line(Block *top, const char *line, int indent_cols){
+  if(top->kind==BLK_RAW){
+    if(top->u.raw_base_cols<0) top->u.raw_base_cols=indent_cols;
+    const char *s=strip_cols(line, top->u.raw_base_cols);
+    emit_default_preamble_once();
+    fputs(s, stdout);
+    fputc('\n', stdout);
+    return;
+  }
+
+  if(top->kind==BLK_MATH){
+    MathBody *m=top->u.math;
+    if(m->base_cols<0) m->base_cols=indent_cols;
+    const char *s=strip_cols(line, m->base_cols);
+    s=lskip_spaces(s);
+
+    if(strcmp(s,"latex:")==0){
+      m->raw_sticky=true;
+      return;
+    }
+
+    math_feed_row(m, inpy_expand(s));
+    return;
+  }
+
+  if(top->kind==BLK_PYTHON){
+    PyBody *py=top->u.py;
+    if(py->base_cols<0) py->base_cols=indent_cols;
+    const char *s=strip_cols(line, py->base_cols);
+    sb_append(&py->code, s);
+    sb_append_char(&py->code, '\n');
+  }
+}
+
+/* Emits a line that is not a header: raw \commands, bare cmd{...} calls,
+   list items inside itemize/enumerate/description, and plain text. */
+static void emit_content_line(const BlockStack *st, const char *content){
+  if(content[0]=='\\'){
+    emit_default_preamble_once();
+    fputs(inpy_expand(content), stdout);
+    fputc('\n', stdout);
+    return;
+  }
+
+  if(looks_like_command_call(content)){
+    emit_default_preamble_once();
+    fputc('\\', stdout);
+    fputs(inpy_expand(content), stdout);
+    fputc('\n', stdout);
+    return;
+  }
+
+  if(inside_list_env(st)){
+    emit_default_preamble_once();
+    const char *item=strip_list_marker(inpy_expand(content));
+    fputs("\\item ", stdout);
+    fputs_n_escapes(item, "\\\\\n");
+    fputc('\n', stdout);
+    return;
+  }
+
+  emit_text_with_n_escapes(content);
+}
+
+static void emit_command_body(const char *name, const char *body){
+  fprintf(stdout, "\\%s{", name);
+  fputs_with_n_escapes_inline(body);
+  fprintf(stdout, "}\n");
+}
+
+/* Opens the block for a latex:, math:, python:, only[...]: or environment
+   header. An only[...] block that does not apply is skipped by the caller. */
+static void open_block(BlockStack *st, const Keyword *kw,
+                       const char *args_before, const char *inline_after, int indent_cols){
+  Block b={0};
+  b.indent_cols=indent_cols;
+
+  if(kw->hdr==HDR_RAW){
+    b.kind=BLK_RAW;
+    b.u.raw_base_cols=-1;
+    stack_push(st,b);
+    return;
+  }
+
+  if(kw->hdr==HDR_MATH){
+    emit_default_preamble_once();
+    fputs("\\[\n\\begin{aligned}\n", stdout);
+    MathBody *m=(MathBody*)xmalloc(sizeof(*m));
+    m->base_cols=-1;
+    m->has_pending=false;
+    m->raw_sticky=false;
+    sb_init(&m->pending);
+    b.kind=BLK_MATH;
+    b.u.math=m;
+    stack_push(st,b);
+    return;
+  }
+
+  if(kw->hdr==HDR_PYTHON){
+    PyBody *py=(PyBody*)xmalloc(sizeof(*py));
+    py->base_cols=-1;
+    py->mode=parse_python_results_mode(args_before);
+    py->limits=parse_python_limits(args_before);
+    py->at=g_inpy.at;
+    sb_init(&py->code);
+    b.kind=BLK_PYTHON;
+    b.u.py=py;
+    stack_push(st,b);
+    return;
+  }
+
+  if(kw->hdr==HDR_ONLY){
+    b.kind=BLK_ONLY;
+    stack_push(st,b);
+    if(inline_after[0] != '\0') emit_text_with_n_escapes(inline_after);
+    return;
+  }
+
+  emit_default_preamble_once();
+  fputs("\\begin{", stdout);
+  fputs(kw->name, stdout);
+  fputc('}', stdout);
+  fputs(args_before, stdout);
+  fputc('\n', stdout);
+
+  b.kind=BLK_ENV;
+  b.u.env=kw;
+  stack_push(st,b);
+
+  if(inline_after[0] != '\0'){
+    emit_text_with_n_escapes(inline_after);
+  }
+}
+
+/* Consumes (and drops) the lines indented under a header that takes no body.
+   Returns the first line that is not, for the caller to process next. */
+static char *skip_indented_children(FILE *fp, int indent_cols){
+  for(;;){
+    char *nxt = read_line(fp);
+    if(!nxt) return NULL;
+
+    rstrip_inplace(nxt);
+    int c2=0;
+    int ind2=calc_indent_cols(nxt, &c2);
+    const char *ct2 = nxt + c2;
+
+    if(is_blank_line(ct2)){ free(nxt); continue; }
+    if(ind2 > indent_cols){ free(nxt); continue; }
+
+    return nxt;
+  }
+}
+
+/* ---- --check ---------------------------------------------------------------
+   Structural lint: follows the same indentation/header rules as translation
+   but only records diagnostics. It never emits output or runs python, so it
+   is cheap enough to run on every keystroke. */
+
+typedef struct { int line; int col; bool is_error; char *msg; } Diag;
+typedef struct { Diag *data; size_t len; size_t cap; } DiagList;
+
+/* Outline and folding data, used by the language server. */
+typedef struct { int line; int col; int level; char *title; } OutlineSym;
+typedef struct { int start; int end; } FoldRange;
+
+typedef enum {
+  CHK_ENV,      /* children are translated normally */
+  CHK_MATH,
+  CHK_RAW,      /* latex: and python: bodies */
+  CHK_BODY,     /* braced command body, joined with \\ */
+  CHK_TITLE,    /* title command; only the first indented line is the title */
+  CHK_SWALLOW   /* command that drops its indented children */
+} CheckKind;
+
+typedef struct {
+  CheckKind kind;
+  int indent_cols;
+  int base_cols;
+  int line, col;
+  int rows;
+  int last_line;   /* last non-blank line inside the block */
+  int sym;         /* CHK_TITLE: outline entry waiting for its title, or -1 */
+  char name[32];
+} CheckBlock;
+
+typedef struct {
+  CheckBlock *data; size_t len; size_t cap;
+  DiagList diags;
+  OutlineSym *syms; size_t nsyms; size_t sym_cap;
+  FoldRange *folds; size_t nfolds; size_t fold_cap;
+} Checker;
+
+static void diag_add(DiagList *dl, int line, int col, bool is_error, const char *fmt, ...){
+  char msg[512];
+  va_list ap;
+  va_start(ap, fmt);
+  vsnprintf(msg, sizeof(msg), fmt, ap);
+  va_end(ap);
+  if(dl->len==dl->cap){
+    dl->cap=dl->cap?dl->cap*2:16;
+    dl->data=(Diag*)xrealloc(dl->data, dl->cap*sizeof(Diag));
+  }
+  Diag *d=&dl->data[dl->len++];
+  d->line=line; d->col=col; d->is_error=is_error; d->msg=xstrdup(msg);
+}
+static void diag_free(DiagList *dl){
+  for(size_t i=0;i<dl->len;i++) free(dl->data[i].msg);
+  free(dl->data); dl->data=NULL; dl->len=dl->cap=0;
+}
+
+static void check_init(Checker *ck){
+  memset(ck,0,sizeof(*ck));
+}
+static void check_free(Checker *ck){
+  free(ck->data);
+  diag_free(&ck->diags);
+  for(size_t i=0;i<ck->nsyms;i++) free(ck->syms[i].title);
+  free(ck->syms);
+  free(ck->folds);
+  memset(ck,0,sizeof(*ck));
+}
+
+static int title_level(const char *name){
+  static const char *const levels[]={
+    "part","chapter","section","subsection","subsubsection","paragraph","subparagraph"
+  };
+  if(streq(name,"frametitle")) return 2;
+  if(streq(name,"framesubtitle")) return 3;
+  for(int i=0;i<(int)(sizeof(levels)/sizeof(levels[0]));i++) if(streq(name,levels[i])) return i;
+  return 2;
+}
+
+static int check_add_sym(Checker *ck, int line, int col, const char *name, const char *title, size_t title_len){
+  if(ck->nsyms==ck->sym_cap){
+    ck->sym_cap=ck->sym_cap?ck->sym_cap*2:16;
+    ck->syms=(OutlineSym*)xrealloc(ck->syms, ck->sym_cap*sizeof(OutlineSym));
+  }
+  OutlineSym *sy=&ck->syms[ck->nsyms];
+  sy->line=line; sy->col=col; sy->level=title_level(name);
+  sy->title=(char*)xmalloc(title_len+1);
+  memcpy(sy->title,title,title_len); sy->title[title_len]='\0';
+  return (int)ck->nsyms++;
+}
+
+static void check_push(Checker *ck, CheckKind kind, int indent_cols, int line, int col, const char *name){
+  if(ck->len==ck->cap){
+    ck->cap=ck->cap?ck->cap*2:16;
+    ck->data=(CheckBlock*)xrealloc(ck->data, ck->cap*sizeof(CheckBlock));
+  }
+  CheckBlock *b=&ck->data[ck->len++];
+  b->kind=kind; b->indent_cols=indent_cols; b->base_cols=-1;
+  b->line=line; b->col=col; b->rows=0;
+  b->last_line=line; b->sym=-1;
+  snprintf(b->name, sizeof(b->name), "%s", name);
+}
+static void check_pop(Checker *ck){
+  CheckBlock *b=&ck->data[--ck->len];
+  if(b->kind==CHK_MATH && b->rows==0){
+    diag_add(&ck->diags, b->line, b->col, false, "empty math: block");
+  }
+  if(b->last_line>b->line){
+    if(ck->nfolds==ck->fold_cap){
+      ck->fold_cap=ck->fold_cap?ck->fold_cap*2:16;
+      ck->folds=(FoldRange*)xrealloc(ck->folds, ck->fold_cap*sizeof(FoldRange));
+    }
+    ck->folds[ck->nfolds].start=b->line;
+    ck->folds[ck->nfolds].end=b->last_line;
+    ck->nfolds++;
+  }
+  if(ck->len && ck->data[ck->len-1].last_line<b->last_line) ck->data[ck->len-1].last_line=b->last_line;
+}
+static void check_finish(Checker *ck){
+  while(ck->len) check_pop(ck);
+}
+
+/* Feeds one source line (already right-stripped) to the checker. */
+static void check_line(Checker *ck, const char *line, int lineno){
+  int consumed=0;
+  int indent_cols=calc_indent_cols(line,&consumed);
+  const char *content=line+consumed;
+  if(is_blank_line(content)) return;
+  int col=consumed+1;
+
+  bool saw_space=false, saw_tab=false;
+  for(int i=0;i<consumed;i++){ if(line[i]=='\t') saw_tab=true; else saw_space=true; }
+  if(saw_space && saw_tab){
+    diag_add(&ck->diags, lineno, 1, false,
+             "indentation mixes tabs and spaces (a tab counts as %d columns)", TAB_WIDTH);
+  }
+
+  while(ck->len && indent_cols<=ck->data[ck->len-1].indent_cols) check_pop(ck);
+
+  if(ck->len){
+    CheckBlock *top=&ck->data[ck->len-1];
+    top->last_line=lineno;
+    if(top->base_cols<0) top->base_cols=indent_cols;
+    else if(indent_cols<top->base_cols){
+      diag_add(&ck->diags, lineno, col, false,
+               "inconsistent indentation under '%s:' (%d columns, its body starts at %d)",
+               top->name, indent_cols, top->base_cols);
+    }
+
+    switch(top->kind){
+      case CHK_SWALLOW:
+        if(top->rows++==0){
+          diag_add(&ck->diags, lineno, col, false,
+                   "indented lines under '%s:' are ignored (it takes no body here)", top->name);
+        }
+        return;
+      case CHK_TITLE:
+        if(top->sym>=0){
+          OutlineSym *sy=&ck->syms[top->sym];
+          free(sy->title);
+          sy->title=xstrdup(content);
+        }
+        check_pop(ck);
+        return;
+      case CHK_MATH:
+        if(!streq(content,"latex:")) top->rows++;
+        return;
+      case CHK_BODY:
+      case CHK_RAW:
+        top->rows++;
+        return;
+      case CHK_ENV:
+        top->rows++;
+        break;
+    }
+  }
+
+  if(!(*content=='_' || isalpha((unsigned char)*content))) return;
+  const char *p=content+1;
+  while(*p=='_'||isalnum((unsigned char)*p)) p++;
+
+  char name[32];
+  size_t name_len=(size_t)(p-content);
+  if(name_len>=sizeof(name)) return;
+  memcpy(name,content,name_len); name[name_len]='\0';
+  if(classify_header(name)==HDR_NONE) return;
+
+  const char *bad=NULL;
+  const char *scan=scan_header_args(p,&bad);
+  if(!scan){
+    if(strchr(bad,':')){
+      diag_add(&ck->diags, lineno, consumed+(int)(bad-content)+1, true,
+               "unbalanced '%c' in '%s:' header; the line is treated as plain text", *bad, name);
+    }
+    return;
+  }
+  if(*scan!=':') return;
+
+  const char *args=lskip_spaces(p);
+  const char *after=lskip_spaces(scan+1);
+  bool has_args=(args!=scan);
+  bool has_inline=(*after!='\0');
+  int sym=-1;
+
+  CheckKind kind=CHK_ENV;
+  switch(classify_header(name)){
+    case HDR_NONE:   return;
+    case HDR_NOBODY:
+    case HDR_CSV:
+    case HDR_BIB:    kind=CHK_SWALLOW; break;
+    case HDR_BRACED: kind=has_args?CHK_SWALLOW:CHK_BODY; break;
+    case HDR_TITLE:
+      if(has_args){
+        /* section[short]{Long}: -- the outline shows the last {...} group. */
+        const char *ae=scan;
+        while(ae>args && (ae[-1]==' '||ae[-1]=='\t')) ae--;
+        const char *as=args;
+        if(ae>args && ae[-1]=='}'){
+          int depth=0;
+          for(const char *q=ae-1; q>=args; q--){
+            if(*q=='}') depth++;
+            else if(*q=='{' && --depth==0){ as=q+1; ae--; break; }
+          }
+        }
+        check_add_sym(ck, lineno, col, name, as, (size_t)(ae-as));
+        kind=CHK_SWALLOW;
+      }
+      else if(has_inline){
+        check_add_sym(ck, lineno, col, name, after, strlen(after));
+        return;
+      }
+      else {
+        sym=check_add_sym(ck, lineno, col, name, "", 0);
+        kind=CHK_TITLE;
+      }
+      break;
+    case HDR_RAW:
+    case HDR_PYTHON: kind=CHK_RAW; break;
+    case HDR_MATH:   kind=CHK_MATH; break;
+    case HDR_ONLY:
+      if(!has_args){
+        diag_add(&ck->diags, lineno, col, false, "'only:' has no [tag] condition, so it always applies");
+      }
+      kind=CHK_ENV;
+      break;
+    case HDR_ENV:    kind=CHK_ENV; break;
+  }
+
+  check_push(ck, kind, indent_cols, lineno, col, name);
+  ck->data[ck->len-1].sym=sym;
+}
+
+static int run_check(FILE *fp, const char *path){
+  Checker ck; check_init(&ck);
+  int lineno=0;
+  for(;;){
+    char *line=read_line(fp);
+    if(!line) break;
+    rstrip_inplace(line);
+    check_line(&ck, line, ++lineno);
+    free(line);
+  }
+  check_finish(&ck);
+
+  for(size_t i=0;i<ck.diags.len;i++){
+    const Diag *d=&ck.diags.data[i];
+    fprintf(stderr, "%s:%d:%d: %s: %s\n", path, d->line, d->col,
+            d->is_error ? "error" : "warning", d->msg);
+  }
+  int status=ck.diags.len ? 1 : 0;
+  check_free(&ck);
+  return status;
+}
+
+/* ---- --ir front end ---------------------------------------------------------
+   Builds the whole document as one flat node array before anything is
+   emitted: one node per source line in source order, each header owning the
+   contiguous nodes below it (its children are [i+1, end)). Line text lives in
+   the arena, a single copy of the source with every line NUL-terminated in
+   place; header names and arguments go to a second string arena. Nodes only
+   hold offsets, so building makes no per-line allocations and walking the
+   array is a linear scan. Emission is a separate pass that reuses the
+   streaming emitters, so both front ends produce identical output. */
+
+typedef enum {
+  IR_BLANK,   /* blank line */
+  IR_SKIP,    /* line dropped by a header that takes no body */
+  IR_TEXT,    /* ordinary line */
+  IR_PLAIN,   /* `name: ...` with an unknown name; always plain text */
+  IR_HEADER,  /* recognized header; `hdr` says which */
+  IR_BODY,    /* line inside a latex:/math:/python: block */
+  IR_ARG      /* body line of a braced command, or a title on its own line */
+} IrKind;
+
+typedef struct {
+  uint8_t  kind;         /* IrKind */
+  uint8_t  hdr;          /* HeaderKind, for IR_HEADER */
+  int32_t  indent_cols;
+  uint32_t lead;         /* indentation bytes in front of the content */
+  uint32_t end;          /* one past the last node of this subtree */
+  uint32_t hstr;         /* IR_HEADER: "name\0args\0inline\0" in `strs` */
+  size_t   text;         /* arena offset of the NUL-terminated content */
+} IrNode;
+
+typedef struct {
+  char *arena; size_t arena_len;
+  StrBuf strs;
+  IrNode *nodes; uint32_t len; uint32_t cap;
+} IrDoc;
+
+/* How an open node claims the lines that follow it while building. */
+typedef enum { IRO_BLOCK, IRO_SKIP, IRO_BODY, IRO_TITLE } IrOpenMode;
+typedef struct { uint32_t node; int indent_cols; IrOpenMode mode; } IrOpen;
+
+static uint32_t ir_add(IrDoc *doc, IrKind kind, int indent_cols, uint32_t lead, size_t text){
+  if(doc->len==doc->cap){
+    doc->cap=doc->cap?doc->cap*2:1024;
+    doc->nodes=(IrNode*)xrealloc(doc->nodes, (size_t)doc->cap*sizeof(IrNode));
+  }
+  IrNode *n=&doc->nodes[doc->len];
+  n->kind=(uint8_t)kind; n->hdr=HDR_NONE;
+  n->indent_cols=indent_cols; n->lead=lead;
+  n->end=doc->len+1; n->hstr=0; n->text=text;
+  return doc->len++;
+}
+
+static void ir_slurp(FILE *fp, IrDoc *doc){
+  StrBuf sb; sb_init(&sb);
+#ifndef _WIN32
+  struct stat sbuf;
+  if(fstat(fileno(fp),&sbuf)==0 && S_ISREG(sbuf.st_mode)) sb_reserve(&sb,(size_t)sbuf.st_size+1);
+#endif
+  char buf[65536]; size_t n;
+  while((n=fread(buf,1,sizeof(buf),fp))>0) sb_append_n(&sb,buf,n);
+  sb_reserve(&sb,sb.len+1);
+  sb.data[sb.len]='\0';
+  doc->arena=sb.data; doc->arena_len=sb.len;
+}
+
+/* Indexes the text already in `doc->arena`. */
+static void ir_index(IrDoc *doc){
+  sb_init(&doc->strs);
+  sb_append_char(&doc->strs,'\0');
+
+  IrOpen *open=NULL; size_t open_len=0, open_cap=0;
+  char *arena=doc->arena;
+  size_t pos=0;
+
+  while(pos<doc->arena_len){
+    char *line=arena+pos;
+    char *nl=(char*)memchr(line,'\n',doc->arena_len-pos);
+    size_t line_len=nl ? (size_t)(nl-line) : doc->arena_len-pos;
+    line[line_len]='\0';
+    pos+=line_len+1;
+    rstrip_inplace(line);
+
+    int consumed=0;
+    int indent_cols=calc_indent_cols(line,&consumed);
+    const char *content=line+consumed;
+    size_t text=(size_t)(content-arena);
+    bool blank=is_blank_line(content);
+
+    if(open_len && open[open_len-1].mode!=IRO_BLOCK){
+      IrOpen *o=&open[open_len-1];
+      if(blank){ ir_add(doc,IR_SKIP,indent_cols,(uint32_t)consumed,text); continue; }
+      if(indent_cols>o->indent_cols){
+        if(o->mode==IRO_SKIP){ ir_add(doc,IR_SKIP,indent_cols,(uint32_t)consumed,text); continue; }
+        ir_add(doc,IR_ARG,indent_cols,(uint32_t)consumed,text);
+        if(o->mode==IRO_TITLE){ doc->nodes[o->node].end=doc->len; open_len--; }
+        continue;
+      }
+      doc->nodes[o->node].end=doc->len;
+      open_len--;
+    }
+
+    if(blank){ ir_add(doc,IR_BLANK,indent_cols,(uint32_t)consumed,text); continue; }
+
+    while(open_len && indent_cols<=open[open_len-1].indent_cols){
+      doc->nodes[open[open_len-1].node].end=doc->len;
+      open_len--;
+    }
+
+    uint8_t parent=open_len ? doc->nodes[open[open_len-1].node].hdr : HDR_ENV;
+    if(parent!=HDR_ENV && parent!=HDR_ONLY){
+      ir_add(doc,IR_BODY,indent_cols,(uint32_t)consumed,text);
+      continue;
+    }
+
+    char *name=NULL, *args_before=NULL, *inline_after=NULL;
+    HeaderKind hk=HDR_NONE;
+    bool is_header=parse_header(content,&name,&args_before,&inline_after);
+    if(is_header) hk=classify_header(name);
+    if(hk==HDR_NONE){
+      ir_add(doc,is_header?IR_PLAIN:IR_TEXT,indent_cols,(uint32_t)consumed,text);
+      free(name); free(args_before); free(inline_after);
+      continue;
+    }
+
+    uint32_t idx=ir_add(doc,IR_HEADER,indent_cols,(uint32_t)consumed,text);
+    IrNode *n=&doc->nodes[idx];
+    n->hdr=(uint8_t)hk;
+    n->hstr=(uint32_t)doc->strs.len;
+    sb_append_n(&doc->strs,name,strlen(name)+1);
+    sb_append_n(&doc->strs,args_before,strlen(args_before)+1);
+    sb_append_n(&doc->strs,inline_after,strlen(inline_after)+1);
+
+    IrOpenMode mode=IRO_BLOCK;
+    bool opens=true;
+    switch(hk){
+      case HDR_NOBODY:
+      case HDR_CSV:
+      case HDR_BIB:    mode=IRO_SKIP; break;
+      case HDR_BRACED: mode=args_before[0] ? IRO_SKIP : IRO_BODY; break;
+      case HDR_TITLE:
+        if(args_before[0]) mode=IRO_SKIP;
+        else if(inline_after[0]) opens=false;
+        else mode=IRO_TITLE;
+        break;
+      default: break;
+    }
+    free(name); free(args_before); free(inline_after);
+
+    if(opens){
+      if(open_len==open_cap){
+        open_cap=open_cap?open_cap*2:64;
+        open=(IrOpen*)xrealloc(open, open_cap*sizeof(IrOpen));
+      }
+      open[open_len].node=idx;
+      open[open_len].indent_cols=indent_cols;
+      open[open_len].mode=mode;
+      open_len++;
+    }
+  }
+
+  while(open_len){ doc->nodes[open[open_len-1].node].end=doc->len; open_len--; }
+  free(open);
+}
+
+static void ir_build(FILE *fp, IrDoc *doc){
+  memset(doc,0,sizeof(*doc));
+  ir_slurp(fp, doc);
+  ir_index(doc);
+}
+
+/* Builds from a copy of `len` bytes at `d`. */
+static void ir_build_mem(const char *d, size_t len, IrDoc *doc){
+  memset(doc,0,sizeof(*doc));
+  doc->arena=(char*)xmalloc(len+1);
+  if(len) memcpy(doc->arena,d,len);
+  doc->arena[len]='\0';
+  doc->arena_len=len;
+  ir_index(doc);
+}
+
+static void ir_free(IrDoc *doc){
+  free(doc->arena);
+  sb_free(&doc->strs);
+  free(doc->nodes);
+  memset(doc,0,sizeof(*doc));
+}
+
+/* Citations in the lines this pass emits: only[...] blocks that do not
+   apply are skipped. Keys point into the arena. */
+static void ir_collect_cite_keys(const IrDoc *doc, CiteKeys *ck){
+  size_t from=0;
+  for(uint32_t i=0;i<doc->len;i++){
+    const IrNode *n=&doc->nodes[i];
+    if(n->kind!=IR_HEADER || n->hdr!=HDR_ONLY) continue;
+    const char *name=doc->strs.data+n->hstr;
+    if(only_active(name+strlen(name)+1)) continue;
+    size_t at=n->text-n->lead;
+    if(at>from) collect_cite_keys(doc->arena+from,at-from,ck);
+    from=(n->end<doc->len) ? doc->nodes[n->end].text-doc->nodes[n->end].lead : doc->arena_len;
+    i=n->end-1;
+  }
+  if(doc->arena_len>from) collect_cite_keys(doc->arena+from,doc->arena_len-from,ck);
+}
+
+static void ir_emit(const IrDoc *doc){
+  BlockStack st; stack_init(&st);
+  uint32_t *ends=NULL; size_t ends_cap=0;
+  const char *arena=doc->arena;
+
+  for(uint32_t i=0;i<doc->len;){
+    while(st.len && ends[st.len-1]<=i) close_one_block(&st);
+
+    const IrNode *n=&doc->nodes[i];
+    const char *text=arena+n->text;
+    Block *top=stack_top(&st);
+    g_inpy.at=i;
+
+    switch((IrKind)n->kind){
+      case IR_BLANK:
+        if(top && top->kind==BLK_MATH) math_blank_line(top->u.math);
+        else fputc('\n', stdout);
+        i++;
+        continue;
+      case IR_SKIP:
+      case IR_ARG:
+        i++;
+        continue;
+      case IR_BODY:
+        emit_block_body_line(top, text-n->lead, n->indent_cols);
+        i++;
+        continue;
+      case IR_TEXT:
+        emit_content_line(&st, text);
+        i++;
+        continue;
+      case IR_PLAIN:
+        emit_text_with_n_escapes(text);
+        i++;
+        continue;
+      case IR_HEADER:
+        break;
+    }
+
+    const char *name=doc->strs.data+n->hstr;
+    const char *args_before=name+strlen(name)+1;
+    const char *inline_after=args_before+strlen(args_before)+1;
+    HeaderKind hk=(HeaderKind)n->hdr;
+
+    switch(hk){
+      case HDR_NONE:
+        break;
+
+      case HDR_NOBODY:
+        emit_default_preamble_once();
+        fprintf(stdout, "\\%s\n", name);
+        break;
+
+      case HDR_BRACED: {
+        emit_default_preamble_once();
+        if(args_before[0] != '\0'){
+          fprintf(stdout, "\\%s%s\n", name, args_before);
+          break;
+        }
+        StrBuf body; sb_init(&body);
+        if(inline_after[0] != '\0') sb_append(&body, inline_after);
+        for(uint32_t j=i+1;j<n->end;j++){
+          if(doc->nodes[j].kind!=IR_ARG) continue;
+          if(body.len > 0) sb_append(&body, " \\\\ ");
+          sb_append(&body, arena+doc->nodes[j].text);
+        }
+        emit_command_body(name, body.data ? body.data : "");
+        sb_free(&body);
+        break;
+      }
+
+      case HDR_TITLE: {
+        emit_default_preamble_once();
+        if(args_before[0] != '\0'){
+          fprintf(stdout, "\\%s%s\n", name, args_before);
+          break;
+        }
+        const char *title=inline_after;
+        if(!title[0]){
+          for(uint32_t j=i+1;j<n->end;j++){
+            if(doc->nodes[j].kind==IR_ARG){ title=arena+doc->nodes[j].text; break; }
+          }
+        }
+        emit_command_body(name, title);
+        break;
+      }
+
+      case HDR_CSV:
+        emit_csv_table(args_before, inline_after);
+        break;
+
+      case HDR_BIB: {
+        CiteKeys ck; memset(&ck,0,sizeof(ck));
+        ir_collect_cite_keys(doc,&ck);
+        emit_bibliography(args_before, inline_after, &ck);
+        cite_keys_free(&ck);
+        break;
+      }
+
+      case HDR_ONLY:
+        if(!only_active(args_before)) break;
+        /* fall through */
+      case HDR_RAW:
+      case HDR_MATH:
+      case HDR_PYTHON:
+      case HDR_ENV:
+        open_block(&st, keyword_find(name), args_before, inline_after, n->indent_cols);
+        if(st.len>ends_cap){
+          ends_cap=st.cap;
+          ends=(uint32_t*)xrealloc(ends, ends_cap*sizeof(uint32_t));
+        }
+        ends[st.len-1]=n->end;
+        i++;
+        continue;
+    }
+    i=n->end;
+  }
+
+  while(st.len>0) close_one_block(&st);
+  stack_free(&st);
+  free(ends);
+
+  emit_end_document_if_needed();
+}
+
+/* ---- --lsp ------------------------------------------------------------------
+   Language server over stdio (JSON-RPC with Content-Length framing). Each open
+   document keeps its line table and its analysis split into segments that
+   start at indent-0 lines: at such a line every block is closed, so a segment
+   can be checked on its own. An edit re-checks from the segment boundary
+   before it until the new lines re-align with an old boundary; later segments
+   are kept and only shifted. Segment results use segment-relative line
+   numbers, so the shift is one add per segment. */
+
+typedef enum { JS_NULL, JS_BOOL, JS_NUM, JS_STR, JS_ARR, JS_OBJ } JsonType;
+
+typedef struct JsonVal {
+  JsonType type;
+  bool b;
+  double num;
+  char *str; size_t str_len;        /* JS_STR (decoded); JS_OBJ keys */
+  struct JsonVal *items; char **keys; size_t n; size_t cap;
+  const char *raw; size_t raw_len;  /* source text, to echo request ids */
+} JsonVal;
+
+#define JSON_MAX_DEPTH 64
+
+static const char *json_ws(const char *p, const char *end){
+  while(p<end && (*p==' '||*p=='\t'||*p=='\r'||*p=='\n')) p++;
+  return p;
+}
+
+static void utf8_put(StrBuf *sb, unsigned cp){
+  char b[4];
+  if(cp<0x80){ b[0]=(char)cp; sb_append_n(sb,b,1); }
+  else if(cp<0x800){ b[0]=(char)(0xC0|(cp>>6)); b[1]=(char)(0x80|(cp&0x3F)); sb_append_n(sb,b,2); }
+  else if(cp<0x10000){ b[0]=(char)(0xE0|(cp>>12)); b[1]=(char)(0x80|((cp>>6)&0x3F)); b[2]=(char)(0x80|(cp&0x3F)); sb_append_n(sb,b,3); }
+  else { b[0]=(char)(0xF0|(cp>>18)); b[1]=(char)(0x80|((cp>>12)&0x3F)); b[2]=(char)(0x80|((cp>>6)&0x3F)); b[3]=(char)(0x80|(cp&0x3F)); sb_append_n(sb,b,4); }
+}
+
+static const char *json_string(const char *p, const char *end, StrBuf *out){
+  p++;
+  while(p<end && *p!='"'){
+    size_t run=0;
+    while(p+run<end && p[run]!='"' && p[run]!='\\') run++;
+    sb_append_n(out,p,run);
+    p+=run;
+    if(p>=end || *p=='"') break;
+    if(++p>=end) return NULL;
+    char c=*p++;
+    switch(c){
+      case 'n': sb_append_char(out,'\n'); break;
+      case 't': sb_append_char(out,'\t'); break;
+      case 'r': sb_append_char(out,'\r'); break;
+      case 'b': sb_append_char(out,'\b'); break;
+      case 'f': sb_append_char(out,'\f'); break;
+      case 'u': {
+        if(end-p<4) return NULL;
+        unsigned cp=(unsigned)strtoul((char[5]){p[0],p[1],p[2],p[3],0},NULL,16);
+        p+=4;
+        if(cp>=0xD800 && cp<0xDC00 && end-p>=6 && p[0]=='\\' && p[1]=='u'){
+          unsigned lo=(unsigned)strtoul((char[5]){p[2],p[3],p[4],p[5],0},NULL,16);
+          if(lo>=0xDC00 && lo<0xE000){ cp=0x10000+((cp-0xD800)<<10)+(lo-0xDC00); p+=6; }
+        }
+        utf8_put(out,cp);
+        break;
+      }
+      default: sb_append_char(out,c); break;
+    }
+  }
+  if(p>=end) return NULL;
+  if(!out->data) sb_append_n(out,"",0);
+  return p+1;
+}
+
+static const char *json_parse(const char *p, const char *end, JsonVal *v, int depth){
+  memset(v,0,sizeof(*v));
+  p=json_ws(p,end);
+  if(p>=end || depth>JSON_MAX_DEPTH) return NULL;
+  v->raw=p;
+
+  if(*p=='"'){
+    StrBuf sb; sb_init(&sb);
+    p=json_string(p,end,&sb);
+    if(!p){ sb_free(&sb); return NULL; }
+    v->type=JS_STR; v->str=sb.data; v->str_len=sb.len;
+  } else if(*p=='{' || *p=='['){
+    bool obj=(*p=='{');
+    char close=obj?'}':']';
+    v->type=obj?JS_OBJ:JS_ARR;
+    p=json_ws(p+1,end);
+    if(p<end && *p==close){ p++; }
+    else for(;;){
+      if(v->n==v->cap){
+        v->cap=v->cap?v->cap*2:4;
+        v->items=(JsonVal*)xrealloc(v->items,v->cap*sizeof(JsonVal));
+        if(obj) v->keys=(char**)xrealloc(v->keys,v->cap*sizeof(char*));
+      }
+      if(obj){
+        p=json_ws(p,end);
+        if(p>=end || *p!='"') return NULL;
+        StrBuf key; sb_init(&key);
+        p=json_string(p,end,&key);
+        if(!p){ sb_free(&key); return NULL; }
+        v->keys[v->n]=key.data;
+        p=json_ws(p,end);
+        if(p>=end || *p!=':'){ free(key.data); return NULL; }
+        p++;
+      }
+      p=json_parse(p,end,&v->items[v->n],depth+1);
+      if(!p){ if(obj) free(v->keys[v->n]); return NULL; }
+      v->n++;
+      p=json_ws(p,end);
+      if(p<end && *p==','){ p++; continue; }
+      if(p<end && *p==close){ p++; break; }
+      return NULL;
+    }
+  } else if(end-p>=4 && memcmp(p,"true",4)==0){ v->type=JS_BOOL; v->b=true; p+=4; }
+  else if(end-p>=5 && memcmp(p,"false",5)==0){ v->type=JS_BOOL; p+=5; }
+  else if(end-p>=4 && memcmp(p,"null",4)==0){ v->type=JS_NULL; p+=4; }
+  else {
+    char num[64]; size_t n=0;
+    while(p+n<end && n<sizeof(num)-1 && strchr("+-0123456789.eE",p[n])) { num[n]=p[n]; n++; }
+    if(!n) return NULL;
+    num[n]='\0';
+    v->type=JS_NUM; v->num=strtod(num,NULL);
+    p+=n;
+  }
+  v->raw_len=(size_t)(p-v->raw);
+  return p;
+}
+
+static void json_free(JsonVal *v){
+  for(size_t i=0;i<v->n;i++){
+    json_free(&v->items[i]);
+    if(v->type==JS_OBJ) free(v->keys[i]);
   }
-  if(b.kind==BLK_MATH){
-    math_flush_pending(&b);
-    fputs("\\end{aligned}\n\\]\n", stdout);
-    return;
+  free(v->items); free(v->keys); free(v->str);
+  memset(v,0,sizeof(*v));
+}
+
+static const JsonVal *json_get(const JsonVal *v, const char *key){
+  if(!v || v->type!=JS_OBJ) return NULL;
+  for(size_t i=0;i<v->n;i++) if(streq(v->keys[i],key)) return &v->items[i];
+  return NULL;
+}
+static const char *json_str(const JsonVal *v){ return (v && v->type==JS_STR) ? v->str : NULL; }
+static int json_int(const JsonVal *v, int dflt){ return (v && v->type==JS_NUM) ? (int)v->num : dflt; }
+
+static void json_put_str(StrBuf *sb, const char *s){
+  sb_append_char(sb,'"');
+  for(; *s; s++){
+    unsigned char c=(unsigned char)*s;
+    if(c=='"' || c=='\\'){ sb_append_char(sb,'\\'); sb_append_char(sb,(char)c); }
+    else if(c=='\n') sb_append(sb,"\\n");
+    else if(c=='\t') sb_append(sb,"\\t");
+    else if(c<0x20){ char u[8]; snprintf(u,sizeof(u),"\\u%04x",c); sb_append(sb,u); }
+    else sb_append_char(sb,(char)c);
   }
-  if(b.kind==BLK_PYTHON){
-    const char *code=b.py_code.data?b.py_code.data:"";
-    char *out=run_python_and_capture(code);
+  sb_append_char(sb,'"');
+}
 
-    emit_default_preamble_once();
-    if(b.py_mode==PYRES_TEX){
-      fputs(out, stdout);
-      if(out[0] && out[strlen(out)-1] != '\n') fputc('\n', stdout);
-    } else {
-      fputs("\\begin{verbatim}\n", stdout);
-      fputs(out, stdout);
-      if(out[0] && out[strlen(out)-1] != '\n') fputc('\n', stdout);
-      fputs("\\end{verbatim}\n", stdout);
+static void lsp_send(StrBuf *body){
+  fprintf(stdout,"Content-Length: %zu\r\n\r\n",body->len);
+  fwrite(body->data,1,body->len,stdout);
+  fflush(stdout);
+}
+
+/* LSP positions count UTF-16 code units; lines are stored as UTF-8. */
+static size_t utf16_to_byte(const char *line, int ch){
+  size_t i=0;
+  while(line[i] && ch>0){
+    unsigned char c=(unsigned char)line[i];
+    size_t n=(c<0x80)?1:(c<0xE0)?2:(c<0xF0)?3:4;
+    ch-=(n==4)?2:1;
+    while(n-- && line[i]) i++;
+  }
+  return i;
+}
+static int byte_to_utf16(const char *line, size_t col){
+  int ch=0;
+  for(size_t i=0;i<col && line[i];i++){
+    unsigned char c=(unsigned char)line[i];
+    if((c&0xC0)!=0x80) ch+=(c>=0xF0)?2:1;
+  }
+  return ch;
+}
+
+typedef struct {
+  int start;     /* first line of the segment (0-based) */
+  int ndiags;    /* ck->diags.len, kept inline so publishing skips clean segments */
+  Checker *ck;   /* results, lines numbered from 1 within the segment */
+} LspSegment;
+
+typedef struct {
+  char *uri;
+  char **lines; size_t nlines; size_t line_cap;
+  LspSegment *segs; size_t nsegs; size_t seg_cap;
+} LspDoc;
+
+static LspDoc *g_lsp_docs=NULL;
+static size_t g_lsp_ndocs=0;
+
+static LspDoc *lsp_find_doc(const char *uri){
+  for(size_t i=0;i<g_lsp_ndocs;i++) if(streq(g_lsp_docs[i].uri,uri)) return &g_lsp_docs[i];
+  return NULL;
+}
+
+static bool lsp_is_boundary(const char *line){
+  return line[0]!=' ' && line[0]!='\t' && !is_blank_line(line);
+}
+
+static void lsp_free_segment(LspSegment *seg){
+  check_free(seg->ck);
+  free(seg->ck);
+  seg->ck=NULL;
+}
+
+static void lsp_check_segment(LspDoc *d, LspSegment *seg, size_t end){
+  StrBuf tmp; sb_init(&tmp);
+  seg->ck=(Checker*)xmalloc(sizeof(Checker));
+  check_init(seg->ck);
+  for(size_t i=(size_t)seg->start;i<end;i++){
+    tmp.len=0;
+    sb_append(&tmp,d->lines[i]);
+    rstrip_inplace(tmp.data);
+    check_line(seg->ck, tmp.data, (int)(i-(size_t)seg->start)+1);
+  }
+  check_finish(seg->ck);
+  free(seg->ck->data); seg->ck->data=NULL; seg->ck->cap=0;
+  seg->ndiags=(int)seg->ck->diags.len;
+  sb_free(&tmp);
+}
+
+/* Re-checks from old segment `k0` on. `edit_end` is the first line after the
+   edited text (new numbering), `old_after` the first old segment lying wholly
+   after the edit, and `delta` the change in line count. */
+static void lsp_reanalyze(LspDoc *d, size_t k0, size_t edit_end, size_t old_after, long delta){
+  LspSegment *fresh=NULL; size_t nfresh=0, fresh_cap=0;
+  size_t kk=old_after;
+  size_t start=(k0<d->nsegs) ? (size_t)d->segs[k0].start : 0;
+  size_t i=start+1;
+  bool aligned=false;
+
+  for(;;){
+    bool at_end=(i>=d->nlines);
+    if(!at_end && !lsp_is_boundary(d->lines[i])){ i++; continue; }
+
+    if(nfresh==fresh_cap){
+      fresh_cap=fresh_cap?fresh_cap*2:8;
+      fresh=(LspSegment*)xrealloc(fresh,fresh_cap*sizeof(LspSegment));
     }
+    fresh[nfresh].start=(int)start;
+    lsp_check_segment(d,&fresh[nfresh],at_end?d->nlines:i);
+    nfresh++;
+    if(at_end) break;
+
+    if(i>=edit_end){
+      while(kk<d->nsegs && (long)d->segs[kk].start+delta<(long)i) kk++;
+      if(kk<d->nsegs && (long)d->segs[kk].start+delta==(long)i){ aligned=true; break; }
+    }
+    start=i++;
+  }
+  if(!aligned) kk=d->nsegs;
+
+  for(size_t k=k0;k<kk;k++) lsp_free_segment(&d->segs[k]);
+  size_t tail=d->nsegs-kk;
+  size_t need=k0+nfresh+tail;
+  if(need>d->seg_cap){
+    d->seg_cap=need*2;
+    d->segs=(LspSegment*)xrealloc(d->segs,d->seg_cap*sizeof(LspSegment));
+  }
+  if(k0+nfresh!=kk) memmove(d->segs+k0+nfresh, d->segs+kk, tail*sizeof(LspSegment));
+  memcpy(d->segs+k0, fresh, nfresh*sizeof(LspSegment));
+  d->nsegs=need;
+  if(delta) for(size_t k=k0+nfresh;k<d->nsegs;k++) d->segs[k].start+=(int)delta;
+  free(fresh);
+}
 
-    free(out);
-    sb_free(&b.py_code);
-    return;
+static void lsp_set_lines(LspDoc *d, size_t from, size_t count, const char *text){
+  /* Replace lines [from, from+count) with the lines of `text`. */
+  size_t nnew=1;
+  for(const char *q=text; *q; q++) if(*q=='\n') nnew++;
+  char **repl=(char**)xmalloc(nnew*sizeof(char*));
+  size_t k=0;
+  const char *ls=text;
+  for(const char *q=text;;q++){
+    if(*q=='\n' || *q=='\0'){
+      size_t n=(size_t)(q-ls);
+      if(n && ls[n-1]=='\r') n--;
+      repl[k]=(char*)xmalloc(n+1);
+      memcpy(repl[k],ls,n); repl[k][n]='\0';
+      k++;
+      if(*q=='\0') break;
+      ls=q+1;
+    }
   }
+  for(size_t i=from;i<from+count;i++) free(d->lines[i]);
+  size_t tail=d->nlines-(from+count);
+  size_t need=from+nnew+tail;
+  if(need>d->line_cap){
+    d->line_cap=need*2;
+    d->lines=(char**)xrealloc(d->lines,d->line_cap*sizeof(char*));
+  }
+  if(nnew!=count) memmove(d->lines+from+nnew, d->lines+from+count, tail*sizeof(char*));
+  memcpy(d->lines+from, repl, nnew*sizeof(char*));
+  d->nlines=need;
+  free(repl);
 }
 
-static void close_blocks_for_indent(BlockStack *st, int indent_cols){
+static void lsp_full_sync(LspDoc *d, const char *text){
+  lsp_set_lines(d,0,d->nlines,text);
+  for(size_t k=0;k<d->nsegs;k++) lsp_free_segment(&d->segs[k]);
+  d->nsegs=0;
+  lsp_reanalyze(d,0,0,0,0);
+}
+
+static void lsp_apply_change(LspDoc *d, const JsonVal *change){
+  const char *text=json_str(json_get(change,"text"));
+  const JsonVal *range=json_get(change,"range");
+  if(!text) return;
+  if(!range){ lsp_full_sync(d,text); return; }
+
+  const JsonVal *rs=json_get(range,"start"), *re=json_get(range,"end");
+  size_t sl=(size_t)json_int(json_get(rs,"line"),0), el=(size_t)json_int(json_get(re,"line"),0);
+  if(d->nlines==0) lsp_set_lines(d,0,0,"");
+  if(sl>=d->nlines) sl=d->nlines-1;
+  if(el>=d->nlines) el=d->nlines-1;
+  if(el<sl) el=sl;
+  size_t sc=utf16_to_byte(d->lines[sl], json_int(json_get(rs,"character"),0));
+  size_t ec=utf16_to_byte(d->lines[el], json_int(json_get(re,"character"),0));
+
+  /* Restart at the last boundary strictly before the edited line. */
+  size_t lo=0, hi=d->nsegs;
+  while(hi-lo>1){
+    size_t mid=lo+(hi-lo)/2;
+    if((size_t)d->segs[mid].start<sl) lo=mid; else hi=mid;
+  }
+  size_t k0=lo;
+  size_t old_after=k0;
+  while(old_after<d->nsegs && (size_t)d->segs[old_after].start<=el) old_after++;
+
+  StrBuf joined; sb_init(&joined);
+  sb_append_n(&joined,d->lines[sl],sc);
+  sb_append(&joined,text);
+  sb_append(&joined,d->lines[el]+ec);
+  size_t before=d->nlines;
+  lsp_set_lines(d,sl,el-sl+1,joined.data);
+  sb_free(&joined);
+
+  long delta=(long)d->nlines-(long)before;
+  size_t edit_end=(size_t)((long)el+1+delta);
+  lsp_reanalyze(d,k0,edit_end,old_after,delta);
+}
+
+static void lsp_put_range(StrBuf *b, int l0, int c0, int l1, int c1){
+  char tmp[160];
+  snprintf(tmp,sizeof(tmp),"{\"start\":{\"line\":%d,\"character\":%d},\"end\":{\"line\":%d,\"character\":%d}}",l0,c0,l1,c1);
+  sb_append(b,tmp);
+}
+
+static void lsp_publish(LspDoc *d, bool clear){
+  StrBuf b; sb_init(&b);
+  sb_append(&b,"{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/publishDiagnostics\",\"params\":{\"uri\":");
+  json_put_str(&b,d->uri);
+  sb_append(&b,",\"diagnostics\":[");
+  bool first=true;
+  for(size_t k=0; !clear && k<d->nsegs; k++){
+    const LspSegment *sg=&d->segs[k];
+    for(int i=0;i<sg->ndiags;i++){
+      const Diag *dg=&sg->ck->diags.data[i];
+      int line=sg->start+dg->line-1;
+      const char *text=((size_t)line<d->nlines) ? d->lines[line] : "";
+      if(!first) sb_append_char(&b,',');
+      first=false;
+      sb_append(&b,"{\"range\":");
+      lsp_put_range(&b,line,byte_to_utf16(text,(size_t)(dg->col-1)),line,byte_to_utf16(text,strlen(text)));
+      sb_append(&b, dg->is_error ? ",\"severity\":1" : ",\"severity\":2");
+      sb_append(&b,",\"source\":\"easylatex\",\"message\":");
+      json_put_str(&b,dg->msg);
+      sb_append_char(&b,'}');
+    }
+  }
+  sb_append(&b,"]}}");
+  lsp_send(&b);
+  sb_free(&b);
+}
+
+static void lsp_reply_begin(StrBuf *b, const JsonVal *id){
+  sb_append(b,"{\"jsonrpc\":\"2.0\",\"id\":");
+  sb_append_n(b,id->raw,id->raw_len);
+  sb_append(b,",\"result\":");
+}
+
+static void lsp_outline(StrBuf *b, const LspDoc *d){
+  /* Flatten all segments, then nest by level: a symbol's range runs until
+     the next symbol at the same or a higher level. */
+  size_t n=0;
+  for(size_t k=0;k<d->nsegs;k++) n+=d->segs[k].ck->nsyms;
+  const OutlineSym **syms=(const OutlineSym**)xmalloc((n?n:1)*sizeof(*syms));
+  int *lines=(int*)xmalloc((n?n:1)*sizeof(int));
+  n=0;
+  for(size_t k=0;k<d->nsegs;k++){
+    for(size_t i=0;i<d->segs[k].ck->nsyms;i++){
+      syms[n]=&d->segs[k].ck->syms[i];
+      lines[n]=d->segs[k].start+syms[n]->line-1;
+      n++;
+    }
+  }
+  int *open=(int*)xmalloc((n?n:1)*sizeof(int));
+  size_t depth=0;
+  int last=d->nlines ? (int)d->nlines-1 : 0;
+
+  sb_append_char(b,'[');
+  for(size_t i=0;i<n;i++){
+    while(depth && syms[open[depth-1]]->level>=syms[i]->level){ sb_append(b,"]}"); depth--; }
+    if(b->data[b->len-1]!='[') sb_append_char(b,',');
+    int end=last;
+    for(size_t j=i+1;j<n;j++) if(syms[j]->level<=syms[i]->level){ end=lines[j]-1; break; }
+    if(end<lines[i]) end=lines[i];
+    const char *endtext=((size_t)end<d->nlines) ? d->lines[end] : "";
+    const char *text=((size_t)lines[i]<d->nlines) ? d->lines[lines[i]] : "";
+
+    sb_append(b,"{\"name\":");
+    json_put_str(b, syms[i]->title[0] ? syms[i]->title : "(untitled)");
+    sb_append(b,",\"kind\":3,\"range\":");   /* SymbolKind.Namespace: a heading */
+    lsp_put_range(b,lines[i],0,end,byte_to_utf16(endtext,strlen(endtext)));
+    sb_append(b,",\"selectionRange\":");
+    lsp_put_range(b,lines[i],byte_to_utf16(text,(size_t)(syms[i]->col-1)),lines[i],byte_to_utf16(text,strlen(text)));
+    sb_append(b,",\"children\":[");
+    open[depth++]=(int)i;
+  }
+  while(depth){ sb_append(b,"]}"); depth--; }
+  sb_append_char(b,']');
+
+  free(open); free(lines); free(syms);
+}
+
+static void lsp_folds(StrBuf *b, const LspDoc *d){
+  char tmp[96];
+  bool first=true;
+  sb_append_char(b,'[');
+  for(size_t k=0;k<d->nsegs;k++){
+    const Checker *ck=d->segs[k].ck;
+    for(size_t i=0;i<ck->nfolds;i++){
+      snprintf(tmp,sizeof(tmp),"%s{\"startLine\":%d,\"endLine\":%d}", first?"":",",
+               d->segs[k].start+ck->folds[i].start-1, d->segs[k].start+ck->folds[i].end-1);
+      sb_append(b,tmp);
+      first=false;
+    }
+  }
+  sb_append_char(b,']');
+}
+
+static void lsp_close_doc(LspDoc *d){
+  for(size_t i=0;i<d->nlines;i++) free(d->lines[i]);
+  for(size_t k=0;k<d->nsegs;k++) lsp_free_segment(&d->segs[k]);
+  free(d->lines); free(d->segs); free(d->uri);
+  *d=g_lsp_docs[--g_lsp_ndocs];
+}
+
+/* Reads one framed message body; NULL at end of input. */
+static char *lsp_read_message(size_t *len_out){
+  char hdr[256];
+  size_t len=0;
+  bool have_len=false;
   for(;;){
-    Block *top=stack_top(st);
-    if(!top) break;
-    if(indent_cols <= top->indent_cols) close_one_block(st);
-    else break;
+    if(!fgets(hdr,(int)sizeof(hdr),stdin)) return NULL;
+    if(hdr[0]=='\r' || hdr[0]=='\n'){ if(have_len) break; continue; }
+    if(strncmp(hdr,"Content-Length:",15)==0){ len=(size_t)strtoull(hdr+15,NULL,10); have_len=true; }
   }
+  char *body=(char*)xmalloc(len+1);
+  if(fread(body,1,len,stdin)!=len){ free(body); return NULL; }
+  body[len]='\0';
+  *len_out=len;
+  return body;
 }
 
-int main(int argc, char **argv){
-  FILE *fp=stdin;
-  if(argc>=2){
-    fp=fopen(argv[1],"rb");
-    if(!fp){ fprintf(stderr,"easylatex: cannot open %s\n", argv[1]); return 1; }
+static int run_lsp(void){
+  bool shutdown=false;
+  for(;;){
+    size_t len=0;
+    char *body=lsp_read_message(&len);
+    if(!body) return shutdown ? 0 : 1;
+
+    JsonVal msg;
+    if(!json_parse(body,body+len,&msg,0)){ json_free(&msg); free(body); continue; }
+    const char *method=json_str(json_get(&msg,"method"));
+    const JsonVal *id=json_get(&msg,"id");
+    const JsonVal *params=json_get(&msg,"params");
+    const JsonVal *td=json_get(params,"textDocument");
+    const char *uri=json_str(json_get(td,"uri"));
+    LspDoc *doc=uri ? lsp_find_doc(uri) : NULL;
+    StrBuf out; sb_init(&out);
+
+    if(!method){
+      /* a response to something we never send */
+    } else if(streq(method,"initialize") && id){
+      lsp_reply_begin(&out,id);
+      sb_append(&out,"{\"capabilities\":{\"textDocumentSync\":{\"openClose\":true,\"change\":2},"
+                     "\"documentSymbolProvider\":true,\"foldingRangeProvider\":true},"
+                     "\"serverInfo\":{\"name\":\"easylatex\"}}}");
+    } else if(streq(method,"shutdown") && id){
+      shutdown=true;
+      lsp_reply_begin(&out,id);
+      sb_append(&out,"null}");
+    } else if(streq(method,"exit")){
+      json_free(&msg); free(body);
+      return shutdown ? 0 : 1;
+    } else if(streq(method,"textDocument/didOpen") && uri){
+      if(!doc){
+        g_lsp_docs=(LspDoc*)xrealloc(g_lsp_docs,(g_lsp_ndocs+1)*sizeof(LspDoc));
+        doc=&g_lsp_docs[g_lsp_ndocs++];
+        memset(doc,0,sizeof(*doc));
+        doc->uri=xstrdup(uri);
+      }
+      const char *text=json_str(json_get(td,"text"));
+      lsp_full_sync(doc, text ? text : "");
+      lsp_publish(doc,false);
+    } else if(streq(method,"textDocument/didChange") && doc){
+      const JsonVal *changes=json_get(params,"contentChanges");
+      for(size_t i=0; changes && changes->type==JS_ARR && i<changes->n; i++){
+        lsp_apply_change(doc,&changes->items[i]);
+      }
+      lsp_publish(doc,false);
+    } else if(streq(method,"textDocument/didClose") && doc){
+      lsp_publish(doc,true);
+      lsp_close_doc(doc);
+    } else if(streq(method,"textDocument/documentSymbol") && id){
+      lsp_reply_begin(&out,id);
+      if(doc) lsp_outline(&out,doc); else sb_append(&out,"[]");
+      sb_append_char(&out,'}');
+    } else if(streq(method,"textDocument/foldingRange") && id){
+      lsp_reply_begin(&out,id);
+      if(doc) lsp_folds(&out,doc); else sb_append(&out,"[]");
+      sb_append_char(&out,'}');
+    } else if(id){
+      sb_append(&out,"{\"jsonrpc\":\"2.0\",\"id\":");
+      sb_append_n(&out,id->raw,id->raw_len);
+      sb_append(&out,",\"error\":{\"code\":-32601,\"message\":\"method not found\"}}");
+    }
+
+    if(out.len) lsp_send(&out);
+    sb_free(&out);
+    json_free(&msg);
+    free(body);
+  }
+}
+
+#ifndef _WIN32
+/* ---- raw passthrough ---------------------------------------------------------
+   A latex: body is copied straight from the mapped input: one slice per line
+   (base indent and trailing blanks cut off, the source newline kept when
+   there is nothing to cut), handed to writev() a batch at a time. The body is
+   always indented under its header, so the slices are never contiguous and a
+   plain sendfile() of the range would not do. */
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define RAW_IOV_BATCH (IOV_MAX<1024 ? IOV_MAX : 1024)
+
+/* Smaller blocks stay on the line-by-line path: for them the flush, seek and
+   stdio refill cost more than the copies saved. */
+#define RAW_PASSTHROUGH_MIN (64u<<10)
+
+/* Written input is unmapped in steps of this size, so a huge block does not
+   pile up in resident memory. */
+#define RAW_RELEASE_STEP (8u<<20)
+
+typedef struct { struct iovec v[RAW_IOV_BATCH]; int n; } IoBatch;
+
+static void iov_flush(IoBatch *b){
+  struct iovec *v=b->v;
+  int n=b->n;
+  while(n>0){
+    ssize_t w=writev(STDOUT_FILENO,v,n);
+    if(w<0){ if(errno==EINTR) continue; die("write to stdout failed"); }
+    while(n>0 && (size_t)w>=v->iov_len){ w-=(ssize_t)v->iov_len; v++; n--; }
+    if(n>0){ v->iov_base=(char*)v->iov_base+w; v->iov_len-=(size_t)w; }
+  }
+  b->n=0;
+}
+
+static void iov_add(IoBatch *b, const char *p, size_t n){
+  if(b->n){
+    struct iovec *last=&b->v[b->n-1];
+    if((const char*)last->iov_base+last->iov_len==p){ last->iov_len+=n; return; }
+  }
+  if(b->n==RAW_IOV_BATCH) iov_flush(b);
+  b->v[b->n].iov_base=(void*)p;
+  b->v[b->n].iov_len=n;
+  b->n++;
+}
+
+static void raw_release_below(MappedFile *src, const char *upto){
+  size_t page=(size_t)sysconf(_SC_PAGESIZE);
+  size_t cut=((size_t)(upto-src->data))/page*page;
+  if(cut<=src->dropped) return;
+  munmap(src->data+src->dropped, cut-src->dropped);
+  src->dropped=cut;
+}
+
+/* Whether the block body starting at `off` (ended by the first non-blank
+   line at or below `indent_cols`) is at least `min` bytes long. */
+static bool raw_block_reaches(const MappedFile *src, size_t off, int indent_cols, size_t min){
+  const char *p=src->data+off, *end=src->data+src->len;
+  if((size_t)(end-p)<min) return false;
+  while(p<end && (size_t)(p-(src->data+off))<min){
+    const char *q=p;
+    int cols=0;
+    while(q<end && (*q==' '||*q=='\t')){ cols+=(*q=='\t')?TAB_WIDTH:1; q++; }
+    const char *r=q;
+    while(r<end && *r!='\n' && isspace((unsigned char)*r)) r++;
+    if(r<end && *r!='\n' && cols<=indent_cols) break;
+    const char *nl=(const char*)memchr(r,'\n',(size_t)(end-r));
+    p=nl ? nl+1 : end;
+  }
+  return (size_t)(p-(src->data+off))>=min;
+}
+
+/* Emits the body of the latex: block `blk` from `src`, starting at byte
+   `off`, exactly as the line-by-line path would. Returns the offset of the
+   first line past the block, or 0 when the block is below
+   RAW_PASSTHROUGH_MIN and is left for the caller to read. */
+static size_t raw_passthrough(MappedFile *src, size_t off, Block *blk){
+  static IoBatch b;
+  static const char nl_only[]="\n";
+  if(off-src->dropped>=RAW_RELEASE_STEP) raw_release_below(src,src->data+off);
+  if(!raw_block_reaches(src,off,blk->indent_cols,RAW_PASSTHROUGH_MIN)) return 0;
+  const char *p=src->data+off, *end=src->data+src->len;
+
+  fflush(stdout);
+  while(p<end){
+    if((size_t)(p-src->data)-src->dropped>=RAW_RELEASE_STEP){
+      iov_flush(&b);
+      raw_release_below(src,p);
+    }
+    const char *nl=(const char*)memchr(p,'\n',(size_t)(end-p));
+    const char *le=nl ? nl : end;
+    const char *next=nl ? nl+1 : end;
+
+    const char *q=p;
+    int cols=0;
+    while(q<le && (*q==' '||*q=='\t')){ cols+=(*q=='\t')?TAB_WIDTH:1; q++; }
+    const char *r=q;
+    while(r<le && isspace((unsigned char)*r)) r++;
+    if(r==le){ iov_add(&b,nl_only,1); p=next; continue; }
+    if(cols<=blk->indent_cols) break;
+
+    if(blk->u.raw_base_cols<0){
+      blk->u.raw_base_cols=cols;
+      if(!g_doc_open){ iov_flush(&b); emit_default_preamble_once(); fflush(stdout); }
+    }
+    const char *e=le;
+    while(e>q && (e[-1]==' '||e[-1]=='\t'||e[-1]=='\r')) e--;
+    const char *s=strip_cols(p,blk->u.raw_base_cols);
+    if(nl && e==le) iov_add(&b,s,(size_t)(next-s));
+    else { iov_add(&b,s,(size_t)(e-s)); iov_add(&b,nl_only,1); }
+    p=next;
   }
+  iov_flush(&b);
+  raw_release_below(src,p);
+  return (size_t)(p-src->data);
+}
+#endif
 
+/* The streaming front end: translates `fp` line by line, with one line of
+   lookahead for headers whose body ends at the next dedent. */
+static void translate_stream(FILE *fp){
   BlockStack st; stack_init(&st);
+  MappedFile src;
+  map_stream(fp,&src);
 
   char *pending_line = NULL;
 
@@ -629,7 +3667,7 @@ int main(int argc, char **argv){
 
     Block *t0=stack_top(&st);
     if(is_blank_line(content)){
-      if(t0 && t0->kind==BLK_MATH) math_blank_line(t0);
+      if(t0 && t0->kind==BLK_MATH) math_blank_line(t0->u.math);
       else fputc('\n', stdout);
       free(line);
       continue;
@@ -638,103 +3676,38 @@ int main(int argc, char **argv){
     close_blocks_for_indent(&st, indent_cols);
     Block *top=stack_top(&st);
 
-    if(top && top->kind==BLK_RAW){
-      if(top->raw_base_cols<0) top->raw_base_cols=indent_cols;
-      const char *s=strip_cols(line, top->raw_base_cols);
-      emit_default_preamble_once();
-      fputs(s, stdout);
-      fputc('\n', stdout);
-      free(line);
-      continue;
-    }
-
-    if(top && top->kind==BLK_MATH){
-      if(top->math_base_cols<0) top->math_base_cols=indent_cols;
-      const char *s=strip_cols(line, top->math_base_cols);
-      s=lskip_spaces(s);
-
-      if(strcmp(s,"latex:")==0){
-        top->math_raw_sticky=true;
-        free(line);
-        continue;
-      }
-
-      math_feed_row(top, s);
-
+    if(top && top->kind!=BLK_ENV && top->kind!=BLK_ONLY){
+      emit_block_body_line(top, line, indent_cols);
       free(line);
       continue;
     }
 
-    if(top && top->kind==BLK_PYTHON){
-      if(top->py_base_cols<0) top->py_base_cols=indent_cols;
-      const char *s=strip_cols(line, top->py_base_cols);
-      sb_append(&top->py_code, s);
-      sb_append_char(&top->py_code, '\n');
+    char *name=NULL, *args_before=NULL, *inline_after=NULL;
+    if(!parse_header(content, &name, &args_before, &inline_after)){
+      emit_content_line(&st, content);
       free(line);
       continue;
     }
 
-    char *name=NULL, *args_before=NULL, *inline_after=NULL;
-    if(parse_header(content, &name, &args_before, &inline_after)){
-
-      if(!is_recognized_header_name(name)){
+    const Keyword *kw=keyword_find(name);
+    switch(kw ? kw->hdr : HDR_NONE){
+      case HDR_NONE:
         emit_text_with_n_escapes(content);
-        free(name); free(args_before); free(inline_after); free(line);
-        continue;
-      }
+        break;
 
-      if(is_nobody_command(name)){
+      case HDR_NOBODY:
         emit_default_preamble_once();
         fprintf(stdout, "\\%s\n", name);
+        pending_line = skip_indented_children(fp, indent_cols);
+        break;
 
-        for(;;){
-          char *nxt = read_line(fp);
-          if(!nxt) break;
-
-          rstrip_inplace(nxt);
-          int c2=0;
-          int ind2=calc_indent_cols(nxt, &c2);
-          const char *ct2 = nxt + c2;
-
-          if(is_blank_line(ct2)){ free(nxt); continue; }
-
-          if(ind2 > indent_cols){
-            free(nxt);
-            continue;
-          }
-
-          pending_line = nxt;
-          break;
-        }
-
-        free(name); free(args_before); free(inline_after); free(line);
-        continue;
-      }
-
-      if(is_braced_command(name)){
+      case HDR_BRACED: {
         emit_default_preamble_once();
 
         if(args_before[0] != '\0'){
           fprintf(stdout, "\\%s%s\n", name, args_before);
-
-          for(;;){
-            char *nxt = read_line(fp);
-            if(!nxt) break;
-
-            rstrip_inplace(nxt);
-            int c2=0;
-            int ind2=calc_indent_cols(nxt, &c2);
-            const char *ct2 = nxt + c2;
-
-            if(is_blank_line(ct2)){ free(nxt); continue; }
-            if(ind2 > indent_cols){ free(nxt); continue; }
-
-            pending_line = nxt;
-            break;
-          }
-
-          free(name); free(args_before); free(inline_after); free(line);
-          continue;
+          pending_line = skip_indented_children(fp, indent_cols);
+          break;
         }
 
         StrBuf body; sb_init(&body);
@@ -765,39 +3738,18 @@ int main(int argc, char **argv){
           free(nxt);
         }
 
-        fprintf(stdout, "\\%s{", name);
-        if(body.data) fputs_with_n_escapes_inline(body.data);
-        fprintf(stdout, "}\n");
-
+        emit_command_body(name, body.data ? body.data : "");
         sb_free(&body);
-        free(name); free(args_before); free(inline_after); free(line);
-        continue;
+        break;
       }
 
-      if(is_title_command(name)){
+      case HDR_TITLE: {
         emit_default_preamble_once();
 
         if(args_before[0] != '\0'){
           fprintf(stdout, "\\%s%s\n", name, args_before);
-
-          for(;;){
-            char *nxt = read_line(fp);
-            if(!nxt) break;
-
-            rstrip_inplace(nxt);
-            int c2=0;
-            int ind2=calc_indent_cols(nxt, &c2);
-            const char *ct2 = nxt + c2;
-
-            if(is_blank_line(ct2)){ free(nxt); continue; }
-            if(ind2 > indent_cols){ free(nxt); continue; }
-
-            pending_line = nxt;
-            break;
-          }
-
-          free(name); free(args_before); free(inline_after); free(line);
-          continue;
+          pending_line = skip_indented_children(fp, indent_cols);
+          break;
         }
 
         char *title = NULL;
@@ -827,120 +3779,344 @@ int main(int argc, char **argv){
           }
         }
 
-        if(!title) title = xstrdup("");
-
-        fprintf(stdout, "\\%s{", name);
-        fputs_with_n_escapes_inline(title);
-        fprintf(stdout, "}\n");
-
+        emit_command_body(name, title ? title : "");
         free(title);
-        free(name); free(args_before); free(inline_after); free(line);
-        continue;
+        break;
       }
 
-      if(streq(name,"latex")){
-        Block b={0};
-        b.kind=BLK_RAW;
-        b.indent_cols=indent_cols;
-        b.raw_base_cols=-1;
-        stack_push(&st,b);
-        free(name); free(args_before); free(inline_after); free(line);
-        continue;
+      case HDR_CSV:
+        emit_csv_table(args_before, inline_after);
+        pending_line = skip_indented_children(fp, indent_cols);
+        break;
+
+      case HDR_BIB: {
+        /* The citations may come later in the input: scan all of it, through
+           an index when only[...] blocks may hide some. */
+        MappedFile in;
+        if((g_input_fp && map_stream(g_input_fp,&in)) || (g_input_path && map_file(g_input_path,&in))){
+          CiteKeys ck; memset(&ck,0,sizeof(ck));
+          if(!mem_contains(in.data,in.len,"only")){
+            collect_cite_keys(in.data,in.len,&ck);
+            emit_bibliography(args_before, inline_after, &ck);
+          } else {
+            IrDoc whole;
+            ir_build_mem(in.data,in.len,&whole);
+            ir_collect_cite_keys(&whole,&ck);
+            emit_bibliography(args_before, inline_after, &ck);
+            ir_free(&whole);
+          }
+          cite_keys_free(&ck);
+          unmap_file(&in);
+        }
+        else emit_bibliography(args_before, inline_after, NULL);
+        pending_line = skip_indented_children(fp, indent_cols);
+        break;
       }
 
-      if(streq(name,"math")){
-        emit_default_preamble_once();
-        fputs("\\[\n\\begin{aligned}\n", stdout);
-        Block b={0};
-        b.kind=BLK_MATH;
-        b.indent_cols=indent_cols;
-        b.math_base_cols=-1;
-        b.math_pending=NULL;
-        b.math_raw_sticky=false;
-        stack_push(&st,b);
-        free(name); free(args_before); free(inline_after); free(line);
-        continue;
-      }
+      case HDR_RAW:
+        open_block(&st, kw, args_before, inline_after, indent_cols);
+#ifndef _WIN32
+        if(src.mapped){
+          off_t off=ftello(fp);
+          size_t next=(off>=0) ? raw_passthrough(&src, (size_t)off, stack_top(&st)) : 0;
+          if(next) fseeko(fp, (off_t)next, SEEK_SET);
+        }
+#endif
+        break;
 
-      if(streq(name,"python")){
-        Block b={0};
-        b.kind=BLK_PYTHON;
-        b.indent_cols=indent_cols;
-        b.py_base_cols=-1;
-        b.py_mode=parse_python_results_mode(args_before);
-        sb_init(&b.py_code);
-        stack_push(&st,b);
-        free(name); free(args_before); free(inline_after); free(line);
-        continue;
-      }
+      case HDR_ONLY:
+        if(!only_active(args_before)){
+          pending_line = skip_indented_children(fp, indent_cols);
+          break;
+        }
+        open_block(&st, kw, args_before, inline_after, indent_cols);
+        break;
+
+      case HDR_MATH:
+      case HDR_PYTHON:
+      case HDR_ENV:
+        open_block(&st, kw, args_before, inline_after, indent_cols);
+        break;
+    }
 
-      if(is_known_environment(name)){
-        emit_default_preamble_once();
-        fprintf(stdout,"\\begin{%s}%s\n", name, args_before);
+    free(name); free(args_before); free(inline_after); free(line);
+  }
+
+  while(st.len>0) close_one_block(&st);
+  stack_free(&st);
 
-        Block b={0};
-        b.kind=BLK_ENV;
-        b.indent_cols=indent_cols;
-        b.env_name=name;
-        b.is_list=is_list_env_name(name);
-        stack_push(&st,b);
+  if(pending_line) free(pending_line);
+  unmap_file(&src);
 
-        if(inline_after[0] != '\0'){
-          emit_text_with_n_escapes(inline_after);
-        }
+  emit_end_document_if_needed();
+}
 
-        free(args_before);
-        free(inline_after);
-        free(line);
-        continue;
+static char *xstrndup(const char *s, size_t n){
+  char *p=(char*)xmalloc(n+1);
+  memcpy(p,s,n); p[n]='\0';
+  return p;
+}
+
+/* Parses a --variant value, `name=key=value,...`. The output defaults to
+   input.name.tex (name.tex for stdin). Returns an error message or NULL. */
+static const char *parse_variant(const char *arg, const char *in_path, Variant *v){
+  memset(v,0,sizeof(*v));
+  size_t name_len=strcspn(arg,"=");
+  if(name_len==0) return "needs a name, like draft=spacing=2";
+  for(size_t i=0;i<name_len;i++){
+    if(!(isalnum((unsigned char)arg[i]) || arg[i]=='_' || arg[i]=='-')) return "name may only use letters, digits, '_' and '-'";
+  }
+  v->name=xstrndup(arg,name_len);
+  v->tags=(char**)xmalloc(sizeof(char*));
+  v->tags[v->ntags++]=xstrndup(arg,name_len);
+
+  for(const char *p=arg+name_len; *p; ){
+    p++;
+    size_t len=strcspn(p,",");
+    const char *eq=memchr(p,'=',len);
+    if(!eq) return "options are key=value pairs separated by ','";
+    size_t key_len=(size_t)(eq-p);
+    const char *val=eq+1;
+    size_t val_len=len-key_len-1;
+    if(key_len==3 && memcmp(p,"out",3)==0){
+      if(!val_len) return "out= needs a file name";
+      free(v->out); v->out=xstrndup(val,val_len);
+    } else if(key_len==7 && memcmp(p,"spacing",7)==0){
+      free(v->spacing); v->spacing=xstrndup(val,val_len);
+      char *end;
+      double x=strtod(v->spacing,&end);
+      if(end==v->spacing || *end || !(x>0)) return "spacing= needs a positive number, like 1.5";
+    } else if(key_len==4 && memcmp(p,"tags",4)==0){
+      for(const char *t=val, *tend=val+val_len; t<tend; ){
+        const char *q=t;
+        while(q<tend && *q!='+') q++;
+        if(q>t){
+          v->tags=(char**)xrealloc(v->tags,(v->ntags+1)*sizeof(char*));
+          v->tags[v->ntags++]=xstrndup(t,(size_t)(q-t));
+        }
+        t=q+1;
       }
+    } else {
+      return "unknown option (use out=, spacing= or tags=)";
+    }
+    p+=len;
+  }
 
-      emit_text_with_n_escapes(content);
-      free(name); free(args_before); free(inline_after); free(line);
-      continue;
+  if(!v->out){
+    StrBuf sb; sb_init(&sb);
+    if(in_path && !streq(in_path,"-")){
+      size_t n=strlen(in_path);
+      if(n>5 && streq(in_path+n-5,".itex")) n-=5;
+      sb_append_n(&sb,in_path,n);
+      sb_append_char(&sb,'.');
     }
+    sb_append(&sb,v->name);
+    sb_append(&sb,".tex");
+    v->out=sb.data;
+  }
+  return NULL;
+}
 
-    if(content[0]=='\\'){
-      emit_default_preamble_once();
-      fputs(content, stdout);
-      fputc('\n', stdout);
-      free(line);
+static void variant_free(Variant *v){
+  for(size_t i=0;i<v->ntags;i++) free(v->tags[i]);
+  free(v->tags); free(v->name); free(v->out); free(v->spacing);
+}
+
+static bool inpy_same_jobs(const InlinePy *a, const InlinePy *b){
+  if(a->len!=b->len) return false;
+  for(size_t i=0;i<a->len;i++){
+    if(a->jobs[i].kind!=b->jobs[i].kind || a->jobs[i].at!=b->jobs[i].at) return false;
+  }
+  return true;
+}
+
+/* One parse, then one emit pass per variant. Python state must not leak
+   from an only[...] block a variant drops, so each variant first gets a
+   silent collect pass; variants that collect the same jobs share one
+   interpreter run. Variants without inline expressions run their blocks
+   isolated, and those share a single run over every only[...] block. */
+static int run_variants(FILE *fp, const Variant *vs, size_t n, bool stats){
+  double t_start=now_seconds();
+  IrDoc doc;
+  ir_build(fp, &doc);
+  double t_built=now_seconds();
+
+  InlinePy *groups=(InlinePy*)xmalloc((n+1)*sizeof(InlinePy));
+  size_t *group_of=(size_t*)xmalloc(n*sizeof(size_t));
+  const size_t none=(size_t)-1;
+  size_t ngroups=0, isolated=none;
+  for(size_t k=0;k<n;k++){
+    g_variant=&vs[k];
+    inpy_begin_collect();
+    ir_emit(&doc);
+    quiet_output(false);
+    if(!inpy_has_exprs()){
+      inpy_cleanup();
+      group_of[k]=none;
       continue;
     }
-
-    if(looks_like_command_call(content)){
-      emit_default_preamble_once();
-      fputc('\\', stdout);
-      fputs(content, stdout);
-      fputc('\n', stdout);
-      free(line);
+    size_t g=0;
+    while(g<ngroups && !inpy_same_jobs(&groups[g],&g_inpy)) g++;
+    if(g<ngroups) inpy_cleanup();
+    else { groups[ngroups++]=g_inpy; memset(&g_inpy,0,sizeof(g_inpy)); }
+    group_of[k]=g;
+  }
+  g_variant=NULL;
+  for(size_t g=0;g<ngroups;g++){
+    g_inpy=groups[g];
+    inpy_run();
+    g_inpy.mode=INPY_EMIT;
+    groups[g]=g_inpy;
+    memset(&g_inpy,0,sizeof(g_inpy));
+  }
+  for(size_t k=0;k<n;k++){
+    if(group_of[k]!=none) continue;
+    if(isolated==none){
+      g_only_all=true;
+      inpy_begin_collect();
+      ir_emit(&doc);
+      quiet_output(false);
+      g_only_all=false;
+      inpy_run_isolated();
+      g_inpy.mode=INPY_EMIT;
+      isolated=ngroups;
+      groups[ngroups++]=g_inpy;
+    }
+    group_of[k]=isolated;
+  }
+  memset(&g_inpy,0,sizeof(g_inpy));
+  double t_collected=now_seconds();
+
+  int status=0;
+  for(size_t k=0;k<n;k++){
+    if(!output_to(vs[k].out)){
+      fprintf(stderr,"easylatex: cannot write %s: %s\n", vs[k].out, strerror(errno));
+      status=1;
       continue;
     }
+    g_variant=&vs[k];
+    g_inpy=groups[group_of[k]];
+    g_inpy.next=0;
+    ir_emit(&doc);
+    output_to(NULL);
+  }
+  g_variant=NULL;
+  for(size_t g=0;g<ngroups;g++){ g_inpy=groups[g]; inpy_cleanup(); }
+  free(groups); free(group_of);
+
+  if(stats){
+    fprintf(stderr,"easylatex: variants: %zu outputs, %zu python runs, build %.3f s, collect+python %.3f s, emit %.3f s, peak RSS %ld KB\n",
+            n, ngroups, t_built-t_start, t_collected-t_built, now_seconds()-t_collected, peak_rss_kb());
+  }
+  ir_free(&doc);
+  return status;
+}
+
+int main(int argc, char **argv){
+  const char *in_path=NULL;
+  bool check_only=false, use_ir=false, stats=false;
+  const char **variant_args=(const char**)xmalloc((size_t)argc*sizeof(char*));
+  size_t nvariants=0;
+  for(int i=1;i<argc;i++){
+    if(streq(argv[i],"--check")) check_only=true;
+    else if(streq(argv[i],"--ir")) use_ir=true;
+    else if(streq(argv[i],"--stats")) stats=true;
+    else if(streq(argv[i],"--lsp")) return run_lsp();
+    else if(streq(argv[i],"--timeout") || streq(argv[i],"--mem")){
+      bool ok=(i+1<argc);
+      if(ok && argv[i][2]=='t') ok=parse_duration_ms(argv[i+1], &g_py_limits.timeout_ms);
+      else if(ok) ok=parse_size_bytes(argv[i+1], &g_py_limits.mem_bytes);
+      if(!ok){ fprintf(stderr,"easylatex: %s needs a value like %s\n", argv[i], argv[i][2]=='t' ? "30s" : "512M"); return 2; }
+      i++;
+    }
+    else if(streq(argv[i],"--variant")){
+      if(i+1>=argc){ fprintf(stderr,"easylatex: --variant needs a value like draft=spacing=2,tags=notes\n"); return 2; }
+      variant_args[nvariants++]=argv[++i];
+    }
+    else if(argv[i][0]=='-' && argv[i][1]){
+      fprintf(stderr,"easylatex: unknown option %s\n", argv[i]);
+      fprintf(stderr,"usage: easylatex [--check | --lsp] [--ir] [--stats] [--timeout 30s] [--mem 1G]\n"
+                     "                 [--variant name=out=f.tex,spacing=1.5,tags=a+b]... [input.itex]\n");
+      return 2;
+    }
+    else in_path=argv[i];
+  }
 
-    if(inside_list_env(&st)){
-      emit_default_preamble_once();
-      const char *item=strip_list_marker(content);
-      fputs("\\item ", stdout);
-      for(size_t i=0; item[i];){
-        if(item[i]=='\\' && item[i+1]=='n'){ fputs("\\\\\n", stdout); i+=2; }
-        else { fputc(item[i], stdout); i++; }
-      }
-      fputc('\n', stdout);
-      free(line);
-      continue;
+  Variant *vs=nvariants ? (Variant*)xmalloc(nvariants*sizeof(Variant)) : NULL;
+  for(size_t k=0;k<nvariants;k++){
+    const char *err=parse_variant(variant_args[k], in_path, &vs[k]);
+    for(size_t j=0;!err && j<k;j++){
+      if(streq(vs[j].name,vs[k].name)) err="name used twice";
+      else if(streq(vs[j].out,vs[k].out)) err="output file used twice";
     }
+    if(err){ fprintf(stderr,"easylatex: --variant %s: %s\n", variant_args[k], err); return 2; }
+  }
+  free(variant_args);
 
-    emit_text_with_n_escapes(content);
-    free(line);
+  FILE *fp=stdin;
+  if(in_path && !streq(in_path,"-")){
+    fp=fopen(in_path,"rb");
+    if(!fp){ fprintf(stderr,"easylatex: cannot open %s\n", in_path); return 1; }
   }
 
-  while(st.len>0) close_one_block(&st);
-  stack_free(&st);
+  if(check_only){
+    double t0=now_seconds();
+    int status=run_check(fp, (fp==stdin) ? "<stdin>" : in_path);
+    if(stats) fprintf(stderr,"easylatex: check: %.3f s, peak RSS %ld KB\n", now_seconds()-t0, peak_rss_kb());
+    if(fp!=stdin) fclose(fp);
+    return status;
+  }
 
-  if(pending_line) free(pending_line);
+  g_input_path=(fp==stdin) ? NULL : in_path;
 
-  emit_end_document_if_needed();
+  if(nvariants){
+    int status=run_variants(fp, vs, nvariants, stats);
+    for(size_t k=0;k<nvariants;k++) variant_free(&vs[k]);
+    free(vs);
+    if(fp!=stdin) fclose(fp);
+    return status;
+  }
+
+  double t_start=now_seconds();
+
+  if(use_ir){
+    IrDoc doc;
+    ir_build(fp, &doc);
+    double t_built=now_seconds();
+    if(has_inline_py(doc.arena, doc.arena_len)){
+      inpy_begin_collect();
+      ir_emit(&doc);
+      inpy_end_collect();
+    }
+    ir_emit(&doc);
+    inpy_cleanup();
+    fflush(stdout);
+    if(stats){
+      fprintf(stderr,"easylatex: ir: %u nodes (%zu KB) + %zu KB arena, build %.3f s, emit %.3f s, peak RSS %ld KB\n",
+              doc.len, (size_t)doc.len*sizeof(IrNode)/1024, (doc.arena_len+doc.strs.len)/1024,
+              t_built-t_start, now_seconds()-t_built, peak_rss_kb());
+    }
+    ir_free(&doc);
+    if(fp!=stdin) fclose(fp);
+    return 0;
+  }
+
+  bool inline_py=input_has_inline_py(&fp);
+  g_input_fp=fp;
+  if(inline_py){
+    inpy_begin_collect();
+    translate_stream(fp);
+    rewind(fp);
+    inpy_end_collect();
+  }
+  translate_stream(fp);
+  inpy_cleanup();
+
+  if(stats){
+    fflush(stdout);
+    fprintf(stderr,"easylatex: stream: %.3f s, peak RSS %ld KB\n", now_seconds()-t_start, peak_rss_kb());
+  }
 
   if(fp!=stdin) fclose(fp);
   return 0;
-}
\ No newline at end of file
+}